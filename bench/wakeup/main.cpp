@@ -0,0 +1,300 @@
+// Measures send-to-callback latency and syscalls per event of each backend.
+//
+// latency: a producer thread sends one event and waits for its callback
+//          before sending the next one.
+// burst:   a producer thread sends events back to back, the backend
+//          coalesces the wakeups.
+//
+// The syscalls of both threads during the burst, the mutexes of the send
+// path included, are counted with the raw_syscalls:sys_enter tracepoint.
+// That needs tracefs and root or perf_event_paranoid <= 1, otherwise they
+// are reported as n/a. Context switches come from getrusage() and are
+// always measured.
+//
+// usage: wakeup_bench [cpu to pin the busy-poll dispatcher to]
+
+#define SEEDSM_LOG_HANDLER(fmt, arg) \
+    {}
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <ev++.h>
+
+#include "seedsm.h"
+#include "seedsm_epoll.h"
+#include "seedsm_busypoll.h"
+
+struct Policy {
+    enum STATE { IDLE };
+    enum EVENT { PING, FIN };
+};
+
+std::string to_string(Policy::STATE st) { return "IDLE"; }
+
+DEFINE_EVENT_WITH_DATA(Policy::PING, int64_t);
+DEFINE_EVENT(Policy::FIN);
+
+using ST = Policy::STATE;
+using EV = Policy::EVENT;
+
+static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+struct PingMachine : public seedsm::StateMachine<Policy> {
+    PingMachine(ev::loop_ref loop) : StateMachine("Root", loop) { setup(); }
+
+    PingMachine(seedsm::Backend& backend) : StateMachine("Root", backend) {
+        setup();
+    }
+
+    void setup() {
+        create_states({ST::IDLE});
+        add_transition<EV::PING>(ST::IDLE);
+        add_transition<EV::FIN>(ST::IDLE);
+
+        on_transition<EV::PING>(ST::IDLE, [this](const int64_t& sent) {
+            if (sent) latencies.push_back(now_ns() - sent);
+            received.fetch_add(1);
+        });
+        on_transition<EV::FIN>(ST::IDLE, [this] { stop(); });
+    }
+
+    std::vector<int64_t> latencies;
+    std::atomic<int> received{0};
+};
+
+static const int kLatencyRounds = 20000;
+static const int kBurstEvents = 100000;
+
+static void latency_producer(PingMachine& sm) {
+    for (int i = 0; i < kLatencyRounds; ++i) {
+        sm.send<EV::PING>(now_ns());
+        while (sm.received.load() != i + 1) {
+            std::this_thread::yield();
+        }
+    }
+    sm.send<EV::FIN>();
+}
+
+static void burst_producer(PingMachine& sm) {
+    for (int i = 0; i < kBurstEvents; ++i) {
+        sm.send<EV::PING>(0);
+    }
+    sm.send<EV::FIN>();
+}
+
+static void report_latency(const char* backend, std::vector<int64_t>& v) {
+    std::sort(v.begin(), v.end());
+    printf("%-8s latency  p50 %7lld ns  p99 %7lld ns  max %9lld ns\n",
+           backend, static_cast<long long>(v[v.size() / 2]),
+           static_cast<long long>(v[v.size() * 99 / 100]),
+           static_cast<long long>(v.back()));
+}
+
+// Counts the syscalls of the calling thread and of the threads it starts
+// afterwards.
+class SyscallCounter {
+public:
+    SyscallCounter() {
+        int id = tracepoint_id();
+        if (id < 0) return;
+
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_TRACEPOINT;
+        attr.size = sizeof(attr);
+        attr.config = id;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        fd_ = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    ~SyscallCounter() {
+        if (fd_ >= 0) close(fd_);
+    }
+
+    SyscallCounter(const SyscallCounter&) = delete;
+    SyscallCounter& operator=(const SyscallCounter&) = delete;
+
+    void start() {
+        if (fd_ >= 0) ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    // returns the count since start(), -1 if unavailable
+    long long stop() {
+        if (fd_ < 0) return -1;
+
+        ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t count;
+        if (read(fd_, &count, sizeof(count)) != sizeof(count)) return -1;
+        return static_cast<long long>(count);
+    }
+
+private:
+    static int tracepoint_id() {
+        const char* paths[] = {
+            "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+            "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"};
+        for (auto path : paths) {
+            if (auto f = fopen(path, "r")) {
+                int id = -1;
+                if (fscanf(f, "%d", &id) != 1) id = -1;
+                fclose(f);
+                if (id >= 0) return id;
+            }
+        }
+        return -1;
+    }
+
+    int fd_ = -1;
+};
+
+// context switches of every thread of the process
+static long long context_switches() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+struct Burst {
+    double seconds;
+    long long syscalls;  // -1 if unavailable
+    long long switches;
+};
+
+static void report_burst(const char* backend, const Burst& burst) {
+    char syscalls[32] = "n/a";
+    if (burst.syscalls >= 0) {
+        snprintf(syscalls, sizeof(syscalls), "%.4f",
+                 static_cast<double>(burst.syscalls) / kBurstEvents);
+    }
+    printf("%-8s burst    %7.0f ns/event  syscalls/event %s  "
+           "switches/event %.4f\n",
+           backend, burst.seconds * 1e9 / kBurstEvents, syscalls,
+           static_cast<double>(burst.switches) / kBurstEvents);
+}
+
+template <typename RUN>
+static Burst run_burst(PingMachine& sm, RUN run) {
+    SyscallCounter counter;
+    auto switches = context_switches();
+    auto start = now_ns();
+    counter.start();
+
+    std::thread producer([&] { burst_producer(sm); });
+    run();
+    producer.join();
+
+    Burst burst;
+    burst.syscalls = counter.stop();
+    burst.seconds = (now_ns() - start) / 1e9;
+    burst.switches = context_switches() - switches;
+    return burst;
+}
+
+static void bench_libev() {
+    {
+        ev::dynamic_loop loop;
+        PingMachine sm(loop);
+        sm.start();
+        std::thread producer([&] { latency_producer(sm); });
+        loop.run(0);
+        producer.join();
+        report_latency("libev", sm.latencies);
+    }
+    {
+        ev::dynamic_loop loop;
+        PingMachine sm(loop);
+        sm.start();
+        report_burst("libev", run_burst(sm, [&] { loop.run(0); }));
+    }
+}
+
+static void bench_epoll() {
+    {
+        seedsm::EpollBackend backend;
+        PingMachine sm(backend);
+        sm.start();
+        std::thread producer([&] { latency_producer(sm); });
+        backend.run();
+        producer.join();
+        report_latency("epoll", sm.latencies);
+    }
+    {
+        seedsm::EpollBackend backend;
+        PingMachine sm(backend);
+        sm.start();
+        report_burst("epoll", run_burst(sm, [&] { backend.run(); }));
+    }
+}
+
+static void bench_manual() {
+    // the host polls continuously, only the send path may block
+    auto pump = [](seedsm::ManualBackend& backend) {
+        while (backend.active() > 0) {
+            if (backend.poll() == 0) std::this_thread::yield();
+        }
+    };
+
+    {
+        seedsm::ManualBackend backend;
+        PingMachine sm(backend);
+        sm.start();
+        std::thread producer([&] { latency_producer(sm); });
+        pump(backend);
+        producer.join();
+        report_latency("manual", sm.latencies);
+    }
+    {
+        seedsm::ManualBackend backend;
+        PingMachine sm(backend);
+        sm.start();
+        report_burst("manual", run_burst(sm, [&] { pump(backend); }));
+    }
+}
+
+// `cpu`: core the busy-poll dispatcher is pinned to, -1 to not pin
+static void bench_busypoll(int cpu) {
+    {
+        seedsm::BusyPollBackend backend;
+        PingMachine sm(backend);
+        sm.start();
+        std::thread producer([&] { latency_producer(sm); });
+        backend.run(cpu);
+        producer.join();
+        report_latency("busypoll", sm.latencies);
+    }
+    {
+        seedsm::BusyPollBackend backend;
+        PingMachine sm(backend);
+        sm.start();
+        report_burst("busypoll", run_burst(sm, [&] { backend.run(cpu); }));
+    }
+}
+
+int main(int argc, char* argv[]) {
+    int cpu = argc > 1 ? atoi(argv[1]) : -1;
+
+    bench_libev();
+    bench_epoll();
+    bench_manual();
+    bench_busypoll(cpu);
+
+    return 0;
+}
@@ -5,6 +5,8 @@
 #include <cstdarg>
 #include <cstring>
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
 
 #include <memory>
 #include <functional>
@@ -13,8 +15,17 @@
 #include <map>
 #include <mutex>
 #include <deque>
+#include <vector>
+#include <algorithm>
+#include <new>
 
+#include <atomic>
+#include <type_traits>
+#include <chrono>
+
+#ifndef SEEDSM_NO_LIBEV
 #include <ev++.h>
+#endif
 
 #ifndef SEEDSM_LOG_HANDLER
 #define SEEDSM_LOG_HANDLER(fmt, arg) \
@@ -65,261 +76,1637 @@ __attribute__((format(printf, 1, 2))) static void abort(const char* fmt, ...) {
     ::abort();
 }
 
+// Source of memory for the internals of a StateMachine, modeled after
+// std::pmr::memory_resource (which is not available in C++11).
+class MemoryResource {
+public:
+    virtual ~MemoryResource() {}
+
+    void* allocate(size_t bytes, size_t alignment = alignof(std::max_align_t)) {
+        return do_allocate(bytes, alignment);
+    }
+
+    void deallocate(void* p, size_t bytes,
+                    size_t alignment = alignof(std::max_align_t)) {
+        do_deallocate(p, bytes, alignment);
+    }
+
+    bool is_equal(const MemoryResource& other) const {
+        return do_is_equal(other);
+    }
+
+protected:
+    virtual void* do_allocate(size_t bytes, size_t alignment) = 0;
+    virtual void do_deallocate(void* p, size_t bytes, size_t alignment) = 0;
+    virtual bool do_is_equal(const MemoryResource& other) const {
+        return this == &other;
+    }
+};
+
+class NewDeleteResource : public MemoryResource {
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        assert(alignment <= alignof(std::max_align_t));
+        return ::operator new(bytes);
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+        ::operator delete(p);
+    }
+};
+
+inline MemoryResource* new_delete_resource() {
+    static NewDeleteResource resource;
+    return &resource;
+}
+
+// Bump allocator releasing all of its memory at once on destruction.
+// Not thread safe: give each machine (or each loop thread) its own arena,
+// and allocate the events sent to the machine from another resource, such
+// as a SynchronizedPoolResource.
+class MonotonicBufferResource : public MemoryResource {
+public:
+    explicit MonotonicBufferResource(
+        size_t initial_size = 4096,
+        MemoryResource* upstream = new_delete_resource())
+        : upstream_(upstream), next_size_(initial_size) {}
+
+    MonotonicBufferResource(void* buffer, size_t size,
+                            MemoryResource* upstream = new_delete_resource())
+        : upstream_(upstream)
+        , current_(static_cast<char*>(buffer))
+        , remaining_(size)
+        , next_size_(size > 0 ? size : 4096) {}
+
+    ~MonotonicBufferResource() { release(); }
+
+    MonotonicBufferResource(const MonotonicBufferResource&) = delete;
+    MonotonicBufferResource& operator=(const MonotonicBufferResource&) =
+        delete;
+
+    void release() {
+        while (chunks_) {
+            auto chunk = chunks_;
+            chunks_ = chunk->next;
+            upstream_->deallocate(chunk, chunk->size);
+        }
+        current_ = nullptr;
+        remaining_ = 0;
+    }
+
+    MemoryResource* upstream_resource() const { return upstream_; }
+
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        auto padding = current_ ? (alignment - reinterpret_cast<uintptr_t>(
+                                                  current_) % alignment) %
+                                      alignment
+                                : 0;
+        if (!current_ || padding + bytes > remaining_) {
+            grow(bytes + alignment);
+            padding = (alignment -
+                       reinterpret_cast<uintptr_t>(current_) % alignment) %
+                      alignment;
+        }
+
+        auto p = current_ + padding;
+        current_ = p + bytes;
+        remaining_ -= padding + bytes;
+        return p;
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {}
+
+private:
+    struct Chunk {
+        Chunk* next;
+        size_t size;
+    };
+
+    void grow(size_t min_size) {
+        auto size = std::max(next_size_, min_size + sizeof(Chunk));
+        auto chunk = static_cast<Chunk*>(upstream_->allocate(size));
+        chunk->next = chunks_;
+        chunk->size = size;
+        chunks_ = chunk;
+
+        current_ = reinterpret_cast<char*>(chunk + 1);
+        remaining_ = size - sizeof(Chunk);
+        next_size_ = size * 2;
+    }
+
+    MemoryResource* upstream_;
+    Chunk* chunks_ = nullptr;
+    char* current_ = nullptr;
+    size_t remaining_ = 0;
+    size_t next_size_;
+};
+
+// Thread safe resource recycling the blocks it serves, modeled after
+// std::pmr::synchronized_pool_resource. Blocks of up to `max_block` bytes
+// are carved from chunks of the upstream resource and kept on a free list
+// per size once deallocated, so the memory used by short-lived objects such
+// as events is bounded by the most alive at once. Larger blocks go straight
+// to the upstream resource.
+class SynchronizedPoolResource : public MemoryResource {
+public:
+    static const size_t max_block = 512;
+
+    explicit SynchronizedPoolResource(
+        MemoryResource* upstream = new_delete_resource())
+        : upstream_(upstream) {}
+
+    ~SynchronizedPoolResource() { release(); }
+
+    SynchronizedPoolResource(const SynchronizedPoolResource&) = delete;
+    SynchronizedPoolResource& operator=(const SynchronizedPoolResource&) =
+        delete;
+
+    // Returns every chunk upstream, whether its blocks are in use or not.
+    void release() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (chunks_) {
+            auto chunk = chunks_;
+            chunks_ = chunk->next;
+            upstream_->deallocate(chunk, chunk->size);
+        }
+        for (auto&& list : free_) {
+            list = nullptr;
+        }
+    }
+
+    MemoryResource* upstream_resource() const { return upstream_; }
+
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (bytes > max_block || alignment > block_align) {
+            return upstream_->allocate(bytes, alignment);
+        }
+
+        auto index = size_class(bytes);
+        if (!free_[index]) grow(index);
+
+        auto block = free_[index];
+        free_[index] = block->next;
+        return block;
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (bytes > max_block || alignment > block_align) {
+            upstream_->deallocate(p, bytes, alignment);
+            return;
+        }
+
+        auto index = size_class(bytes);
+        auto block = static_cast<Block*>(p);
+        block->next = free_[index];
+        free_[index] = block;
+    }
+
+private:
+    struct Block {
+        Block* next;
+    };
+
+    struct alignas(std::max_align_t) Chunk {
+        Chunk* next;
+        size_t size;
+    };
+
+    static const size_t block_align = alignof(std::max_align_t);
+    static const size_t min_block = 16;
+    static const size_t class_count = 6;  // 16 to 512 bytes
+    static const size_t chunk_size = 4096;
+
+    static size_t size_class(size_t bytes) {
+        size_t index = 0;
+        for (size_t size = min_block; size < bytes; size <<= 1) {
+            ++index;
+        }
+        return index;
+    }
+
+    // carves a new chunk into blocks of class `index`
+    void grow(size_t index) {
+        size_t block_size = min_block << index;
+        size_t count = std::max<size_t>(1, chunk_size / block_size);
+        size_t size = sizeof(Chunk) + count * block_size;
+
+        auto chunk = static_cast<Chunk*>(upstream_->allocate(size));
+        chunk->next = chunks_;
+        chunk->size = size;
+        chunks_ = chunk;
+
+        auto base = reinterpret_cast<char*>(chunk + 1);
+        for (size_t i = count; i-- > 0;) {
+            auto block = reinterpret_cast<Block*>(base + i * block_size);
+            block->next = free_[index];
+            free_[index] = block;
+        }
+    }
+
+    MemoryResource* upstream_;
+    std::mutex mutex_;
+    Chunk* chunks_ = nullptr;
+    Block* free_[class_count] = {};
+};
+
+// Allocator adapter for standard containers, modeled after
+// std::pmr::polymorphic_allocator.
+template <typename T>
+class PolymorphicAllocator {
+public:
+    using value_type = T;
+
+    PolymorphicAllocator() : resource_(new_delete_resource()) {}
+
+    PolymorphicAllocator(MemoryResource* resource) : resource_(resource) {
+        assert(resource_);
+    }
+
+    template <typename U>
+    PolymorphicAllocator(const PolymorphicAllocator<U>& other)
+        : resource_(other.resource()) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(
+            resource_->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, size_t n) {
+        resource_->deallocate(p, n * sizeof(T), alignof(T));
+    }
+
+    MemoryResource* resource() const { return resource_; }
+
+private:
+    MemoryResource* resource_;
+};
+
+template <typename T, typename U>
+bool operator==(const PolymorphicAllocator<T>& a,
+                const PolymorphicAllocator<U>& b) {
+    return a.resource() == b.resource() ||
+           a.resource()->is_equal(*b.resource());
+}
+
+template <typename T, typename U>
+bool operator!=(const PolymorphicAllocator<T>& a,
+                const PolymorphicAllocator<U>& b) {
+    return !(a == b);
+}
+
 namespace _inner {
 
-class EventBase {};
+template <typename T>
+using List = std::list<T, PolymorphicAllocator<T>>;
+
+template <typename T>
+using Deque = std::deque<T, PolymorphicAllocator<T>>;
+
+template <typename T>
+using Vector = std::vector<T, PolymorphicAllocator<T>>;
+
+template <typename K, typename V>
+using Map = std::map<K, V, std::less<K>,
+                     PolymorphicAllocator<std::pair<const K, V>>>;
+
+using String =
+    std::basic_string<char, std::char_traits<char>, PolymorphicAllocator<char>>;
+
+template <typename T, typename... Args>
+T* create(MemoryResource* resource, Args&&... args) {
+    void* p = resource->allocate(sizeof(T), alignof(T));
+    try {
+        return new (p) T(std::forward<Args>(args)...);
+    } catch (...) {
+        resource->deallocate(p, sizeof(T), alignof(T));
+        throw;
+    }
+}
+
+template <typename T>
+void destroy(MemoryResource* resource, T* p) {
+    p->~T();
+    resource->deallocate(p, sizeof(T), alignof(T));
+}
+
+// Callbacks of a machine definition receive the machine instance as
+// `CONTEXT&`; with `void` they take no context.
+template <typename CONTEXT, typename... ARGS>
+struct Callback {
+    using type = std::function<void(CONTEXT&, ARGS...)>;
+
+    static void invoke(const type& fn, CONTEXT* ctx, ARGS... args) {
+        fn(*ctx, args...);
+    }
+};
+
+template <typename... ARGS>
+struct Callback<void, ARGS...> {
+    using type = std::function<void(ARGS...)>;
+
+    static void invoke(const type& fn, void* ctx, ARGS... args) {
+        fn(args...);
+    }
+};
+
+// adapts a callback taking no context to a definition with one
+template <typename CONTEXT, typename... ARGS>
+typename Callback<CONTEXT, ARGS...>::type ignore_context(
+    std::function<void(ARGS...)> fn) {
+    return [fn](CONTEXT&, ARGS... args) { fn(args...); };
+}
+
+class EventBase {
+public:
+    // releases the event to the resource it was allocated from
+    virtual void destroy() const = 0;
+
+    // link of intrusive event queues
+    EventBase* next = nullptr;
+
+protected:
+    ~EventBase() {}
+};
+
+// deleter for objects released through their own `destroy()`
+struct Deleter {
+    template <typename T>
+    void operator()(T* p) const {
+        p->destroy();
+    }
+};
+
+// FIFO of events linked through `EventBase::next`. Circular, so that the
+// last event is the only pointer to keep.
+class EventQueue {
+public:
+    EventQueue() {}
+
+    EventQueue(const EventQueue&) = delete;
+    EventQueue& operator=(const EventQueue&) = delete;
+
+    bool empty() const { return !tail_; }
+
+    void push_back(EventBase* ev) {
+        if (tail_) {
+            ev->next = tail_->next;
+            tail_->next = ev;
+        } else {
+            ev->next = ev;
+        }
+        tail_ = ev;
+    }
+
+    EventBase* pop_front() {
+        if (!tail_) return nullptr;
+
+        auto head = tail_->next;
+        if (head == tail_) {
+            tail_ = nullptr;
+        } else {
+            tail_->next = head->next;
+        }
+        head->next = nullptr;
+        return head;
+    }
+
+    // moves the events of `other` before the first one of this queue
+    void splice_front(EventQueue& other) {
+        if (!other.tail_) return;
+
+        if (tail_) {
+            auto head = tail_->next;
+            tail_->next = other.tail_->next;
+            other.tail_->next = head;
+        } else {
+            tail_ = other.tail_;
+        }
+        other.tail_ = nullptr;
+    }
+
+    // moves the events of `other` after the last one of this queue
+    void splice_back(EventQueue& other) {
+        if (!other.tail_) return;
+
+        if (tail_) {
+            auto head = tail_->next;
+            tail_->next = other.tail_->next;
+            other.tail_->next = head;
+        }
+        tail_ = other.tail_;
+        other.tail_ = nullptr;
+    }
+
+    void clear() {
+        while (auto ev = pop_front()) {
+            ev->destroy();
+        }
+    }
+
+private:
+    EventBase* tail_ = nullptr;
+};
 
 template <typename EVENT_ENUM>
 class Event : public EventBase {
     EVENT_ENUM event_type_;
     std::function<void()> on_delete_fn_;
 
+protected:
+    MemoryResource* resource_;
+
 public:
-    Event(EVENT_ENUM event_type) : event_type_(event_type) {}
+    Event(EVENT_ENUM event_type, MemoryResource* resource)
+        : event_type_(event_type), resource_(resource) {}
 
-    ~Event() {
+    virtual ~Event() {
         if (on_delete_fn_) on_delete_fn_();
     }
 
     EVENT_ENUM type() const { return event_type_; };
 
+    // the event to dispatch, the referenced one for SharedEventRef
+    virtual const Event* target() const { return this; }
+
     void on_delete(std::function<void()> fn) { on_delete_fn_ = fn; }
 };
 
 template <typename EVENT_ENUM, EVENT_ENUM EVENT>
 class EventImpl : public Event<EVENT_ENUM> {
-    EventImpl() : Event<EVENT_ENUM>(EVENT) {}
+    explicit EventImpl(MemoryResource* resource)
+        : Event<EVENT_ENUM>(EVENT, resource) {}
+
+public:
+    template <typename CONTEXT>
+    using context_callback_type = typename Callback<CONTEXT>::type;
+    using callback_type = context_callback_type<void>;
+    static const EVENT_ENUM event_type = EVENT;
+    using data_type = void;
+
+    static EventImpl* create(MemoryResource* resource = new_delete_resource()) {
+        void* p = resource->allocate(sizeof(EventImpl), alignof(EventImpl));
+        return new (p) EventImpl(resource);
+    }
+
+    void destroy() const override {
+        _inner::destroy(this->resource_, const_cast<EventImpl*>(this));
+    }
+
+    template <typename CONTEXT>
+    void exec(const context_callback_type<CONTEXT>& fn, CONTEXT* ctx) const {
+        Callback<CONTEXT>::invoke(fn, ctx);
+    }
+};
+
+template <typename EVENT_ENUM, EVENT_ENUM EVENT, typename DATATYPE>
+class EventImplWithData : public Event<EVENT_ENUM> {
+    EventImplWithData(MemoryResource* resource, const DATATYPE& data)
+        : Event<EVENT_ENUM>(EVENT, resource), data(data) {}
+
+public:
+    const DATATYPE data;
+    template <typename CONTEXT>
+    using context_callback_type =
+        typename Callback<CONTEXT, const DATATYPE&>::type;
+    using callback_type = context_callback_type<void>;
+    static const EVENT_ENUM event_type = EVENT;
+    using data_type = DATATYPE;
+
+    static EventImplWithData* create(const DATATYPE& data) {
+        return create(new_delete_resource(), data);
+    }
+
+    static EventImplWithData* create(MemoryResource* resource,
+                                     const DATATYPE& data) {
+        void* p = resource->allocate(sizeof(EventImplWithData),
+                                     alignof(EventImplWithData));
+        try {
+            return new (p) EventImplWithData(resource, data);
+        } catch (...) {
+            resource->deallocate(p, sizeof(EventImplWithData),
+                                 alignof(EventImplWithData));
+            throw;
+        }
+    }
+
+    void destroy() const override {
+        _inner::destroy(this->resource_,
+                        const_cast<EventImplWithData*>(this));
+    }
+
+    template <typename CONTEXT>
+    void exec(const context_callback_type<CONTEXT>& fn, CONTEXT* ctx) const {
+        Callback<CONTEXT, const DATATYPE&>::invoke(fn, ctx, data);
+    }
+};
+
+// Reference to an event shared by several machines, e.g. a broadcast, to
+// park it in the intrusive queue of one of them.
+template <typename EVENT_ENUM>
+class SharedEventRef : public Event<EVENT_ENUM> {
+public:
+    SharedEventRef(std::shared_ptr<const Event<EVENT_ENUM>> target,
+                   MemoryResource* resource)
+        : Event<EVENT_ENUM>(target->type(), resource)
+        , target_(std::move(target)) {}
+
+    const Event<EVENT_ENUM>* target() const override { return target_.get(); }
+
+    void destroy() const override {
+        _inner::destroy(this->resource_, const_cast<SharedEventRef*>(this));
+    }
+
+private:
+    std::shared_ptr<const Event<EVENT_ENUM>> target_;
+};
+
+template <typename EVENT, typename EVENT_ENUM>
+inline EVENT* event_cast(Event<EVENT_ENUM>* ev) {
+    if (ev->EventType() == static_cast<EVENT_ENUM>(EVENT::event_type)) {
+        return static_cast<EVENT*>(ev);
+    }
+
+    return nullptr;
+}
+
+// Active states of a machine, as a bitset indexed by state index.
+// Machines with up to 64 states don't allocate.
+class Configuration {
+public:
+    Configuration() : bits_(0), word_count_(1) {}
+
+    Configuration(size_t state_count, MemoryResource* resource) {
+        assign(state_count, resource);
+    }
+
+    Configuration(const Configuration&) = delete;
+    Configuration& operator=(const Configuration&) = delete;
+
+    // Clears the configuration. Must be released beforehand.
+    void assign(size_t state_count, MemoryResource* resource) {
+        word_count_ = (state_count + 63) / 64;
+        if (word_count_ <= 1) {
+            word_count_ = 1;
+            bits_ = 0;
+            return;
+        }
+
+        words_ = static_cast<uint64_t*>(resource->allocate(
+            allocated_words() * sizeof(uint64_t), alignof(uint64_t)));
+        memset(words_, 0, word_count_ * sizeof(uint64_t));
+    }
+
+    // must be called with the resource passed to `assign()`
+    void release(MemoryResource* resource) {
+        if (word_count_ > 1) {
+            resource->deallocate(words_, allocated_words() * sizeof(uint64_t),
+                                 alignof(uint64_t));
+        }
+        word_count_ = 1;
+        bits_ = 0;
+    }
+
+    size_t word_count() const { return word_count_; }
+
+    // Configurations up to this size are copied on the stack by dispatch.
+    static const size_t stack_words = 4;
+
+    // `word_count()` words for the copy of larger configurations, allocated
+    // along with them. Null for smaller ones.
+    uint64_t* scratch() const {
+        return word_count_ > stack_words ? words_ + word_count_ : nullptr;
+    }
+
+    // incremented by every `set()` and `reset()`
+    uint32_t generation() const { return generation_; }
+
+    uint64_t* words() { return word_count_ > 1 ? words_ : &bits_; }
+    const uint64_t* words() const { return word_count_ > 1 ? words_ : &bits_; }
+
+    static bool test(const uint64_t* words, size_t index) {
+        return (words[index / 64] >> (index % 64)) & 1;
+    }
+
+    bool test(size_t index) const { return test(words(), index); }
+
+    void set(size_t index) {
+        words()[index / 64] |= uint64_t(1) << (index % 64);
+        ++generation_;
+    }
+
+    void reset(size_t index) {
+        words()[index / 64] &= ~(uint64_t(1) << (index % 64));
+        ++generation_;
+    }
+
+private:
+    union {
+        uint64_t bits_;
+        uint64_t* words_;
+    };
+    size_t allocated_words() const {
+        return word_count_ > stack_words ? 2 * word_count_ : word_count_;
+    }
+
+    uint32_t word_count_;
+    uint32_t generation_ = 0;
+};
+
+// Set of states of a definition, as words of a Configuration. Only as long
+// as the highest state it holds.
+class StateSet {
+public:
+    explicit StateSet(MemoryResource* resource) : words_(resource) {}
+
+    void set(size_t index) {
+        if (words_.size() <= index / 64) words_.resize(index / 64 + 1, 0);
+        words_[index / 64] |= uint64_t(1) << (index % 64);
+    }
+
+    // whether a state of the set is active in `config`
+    bool intersects(const Configuration& config) const {
+        auto words = config.words();
+        auto count = std::min<size_t>(words_.size(), config.word_count());
+        for (size_t i = 0; i < count; ++i) {
+            if (words[i] & words_[i]) return true;
+        }
+        return false;
+    }
+
+private:
+    Vector<uint64_t> words_;
+};
+
+// Copy of a Configuration which any thread can read without locking. Up to
+// 64 states it is a single atomic word. Larger configurations are guarded
+// by a sequence lock: writes never wait, and readers of a whole copy retry
+// while a write is in progress.
+class PublishedConfiguration {
+public:
+    PublishedConfiguration() {}
+
+    PublishedConfiguration(const PublishedConfiguration&) = delete;
+    PublishedConfiguration& operator=(const PublishedConfiguration&) = delete;
+
+    // Sizes the copy, once. Must be released with the same resource when no
+    // reader is left.
+    void reserve(size_t word_count, MemoryResource* resource) {
+        if (word_count <= 1 || words_.load(std::memory_order_relaxed)) {
+            return;
+        }
+
+        auto words = static_cast<std::atomic<uint64_t>*>(resource->allocate(
+            word_count * sizeof(std::atomic<uint64_t>),
+            alignof(std::atomic<uint64_t>)));
+        for (size_t i = 0; i < word_count; ++i) {
+            new (&words[i]) std::atomic<uint64_t>(0);
+        }
+        word_count_ = word_count;
+        words_.store(words, std::memory_order_release);
+    }
+
+    void release(MemoryResource* resource) {
+        auto words = words_.load(std::memory_order_relaxed);
+        if (!words) return;
+
+        resource->deallocate(words, word_count_ * sizeof(std::atomic<uint64_t>),
+                             alignof(std::atomic<uint64_t>));
+        words_.store(nullptr, std::memory_order_relaxed);
+    }
+
+    // Single writer. `config` must have the reserved size.
+    void publish(const Configuration& config) {
+        auto words = words_.load(std::memory_order_relaxed);
+        if (!words) {
+            bits_.store(config.words()[0], std::memory_order_release);
+            return;
+        }
+
+        assert(config.word_count() == word_count_);
+        auto seq = sequence_.load(std::memory_order_relaxed);
+        sequence_.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        for (size_t i = 0; i < word_count_; ++i) {
+            words[i].store(config.words()[i], std::memory_order_relaxed);
+        }
+
+        sequence_.store(seq + 2, std::memory_order_release);
+    }
+
+    size_t word_count() const {
+        return words_.load(std::memory_order_acquire) ? word_count_ : 1;
+    }
+
+    // a single word is always consistent, no retry
+    bool test(size_t index) const {
+        auto words = words_.load(std::memory_order_acquire);
+        if (!words) {
+            return index < 64 &&
+                   ((bits_.load(std::memory_order_acquire) >> index) & 1);
+        }
+
+        if (index / 64 >= word_count_) return false;
+        auto word = words[index / 64].load(std::memory_order_acquire);
+        return (word >> (index % 64)) & 1;
+    }
+
+    // Copies up to `count` words of a consistent copy into `out`. Returns
+    // how many were copied.
+    size_t load(uint64_t* out, size_t count) const {
+        auto words = words_.load(std::memory_order_acquire);
+        if (!words) {
+            if (count == 0) return 0;
+            out[0] = bits_.load(std::memory_order_acquire);
+            return 1;
+        }
+
+        count = std::min<size_t>(count, word_count_);
+        for (;;) {
+            auto seq = sequence_.load(std::memory_order_acquire);
+            if (seq & 1) continue;  // being written
+
+            for (size_t i = 0; i < count; ++i) {
+                out[i] = words[i].load(std::memory_order_relaxed);
+            }
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence_.load(std::memory_order_relaxed) == seq) {
+                return count;
+            }
+        }
+    }
+
+private:
+    std::atomic<uint64_t> bits_{0};
+    std::atomic<std::atomic<uint64_t>*> words_{nullptr};
+    size_t word_count_ = 1;
+    std::atomic<uint32_t> sequence_{0};  // odd while a copy is written
+};
+
+// Node of a machine definition. The active flags live in a Configuration.
+template <typename CONTEXT>
+struct State {
+    using callback_type = typename Callback<CONTEXT>::type;
+
+    State(const std::string& name, size_t index, State* parent = nullptr,
+          MemoryResource* resource = new_delete_resource())
+        : name_(name.c_str(), resource)
+        , index_(index)
+        , parent_(parent)
+        , children_(resource)
+        , on_entered_callbacks_(resource)
+        , on_exited_callbacks_(resource) {
+        if (parent) {
+            parent->add_child(this);
+        }
+    }
+
+    size_t index() const { return index_; }
+
+    const State* parent() const { return parent_; }
+
+    const List<State*>& children() const { return children_; }
+
+    const char* name() const { return name_.c_str(); }
+
+    void on_entered(callback_type fn) { on_entered_callbacks_.push_back(fn); }
+
+    void on_exited(callback_type fn) { on_exited_callbacks_.push_back(fn); }
+
+    void set_parallel(bool is_par) { is_parallel_ = is_par; }
+
+    bool is_parallel() const { return is_parallel_; }
+
+    void do_enter_callback(const EventBase* event, CONTEXT* ctx) const {
+        for (auto& fn : on_entered_callbacks_) {
+            Callback<CONTEXT>::invoke(fn, ctx);
+        }
+    }
+
+    void do_exit_callback(const EventBase* event, CONTEXT* ctx) const {
+        for (auto& fn : on_exited_callbacks_) {
+            Callback<CONTEXT>::invoke(fn, ctx);
+        }
+    }
+
+private:
+    void add_child(State* child) {
+        if (!child) return;
+
+        children_.push_back(child);
+    }
+
+private:
+    String name_;
+    size_t index_;
+    State* parent_;
+    List<State*> children_;
+    bool is_parallel_ = false;
+
+    List<callback_type> on_entered_callbacks_;
+    List<callback_type> on_exited_callbacks_;
+};
+
+template <typename CONTEXT>
+struct Transition {
+    Transition(const State<CONTEXT>* source = nullptr,
+               const State<CONTEXT>* target = nullptr)
+        : source_(source), target_(target) {}
+
+    // virtual bool event_test(Event* ev) = 0;
+
+    virtual ~Transition() {}
+
+    const State<CONTEXT>* source_state() const { return source_; }
+
+    const State<CONTEXT>* target_state() const { return target_; }
+
+    virtual void do_callback(const EventBase* ev, CONTEXT* ctx) const = 0;
+
+    // releases the transition to the resource it was allocated from
+    virtual void destroy() = 0;
+
+private:
+    const State<CONTEXT>* source_;
+    const State<CONTEXT>* target_;
+};
+
+template <typename EVENT_CLASS, typename CONTEXT>
+struct TransitionImpl : public Transition<CONTEXT> {
+    using callback_type =
+        typename EVENT_CLASS::template context_callback_type<CONTEXT>;
+
+    explicit TransitionImpl(const State<CONTEXT>* source = nullptr,
+                            const State<CONTEXT>* target = nullptr,
+                            MemoryResource* resource = new_delete_resource())
+        : Transition<CONTEXT>(source, target)
+        , func_list_(resource)
+        , failed_func_list_(resource) {}
+
+    void destroy() override {
+        _inner::destroy(func_list_.get_allocator().resource(), this);
+    }
+
+    void on_transition(callback_type fn) { func_list_.push_back(fn); }
+
+    void on_transition_failed(callback_type fn) {
+        failed_func_list_.push_back(fn);
+    }
+
+protected:
+    // bool event_test(Event* ev) override {
+    //     auto event = static_cast<EVENT_CLASS*>(ev);
+    //     if (event->type() != EVENT_CLASS::event_type) return false;
+
+    //     return true;
+    // }
+
+    void do_callback(const EventBase* ev, CONTEXT* ctx) const override {
+        for (auto& fn : func_list_) {
+            auto event = static_cast<const EVENT_CLASS*>(ev);
+            event->exec(fn, ctx);
+        }
+    }
+
+private:
+    List<callback_type> func_list_;
+    List<callback_type> failed_func_list_;
+};
+}  // _inner
+
+// Topology and callbacks of a machine: states, hierarchy and transitions.
+// Once built it is only read, so one definition can be shared by any number
+// of machines, even on different threads. The callbacks receive the machine
+// being dispatched as `CONTEXT&` (nothing when `CONTEXT` is void).
+template <typename STATE_POLICY, typename CONTEXT = void>
+class StateMachineDefinition {
+public:
+    using STATE_ID = typename STATE_POLICY::STATE;
+    using EVENT_ID = typename STATE_POLICY::EVENT;
+
+    template <EVENT_ID EVENT>
+    using event_class = typename _EventCreator<
+        decltype(EVENT), static_cast<int>(EVENT)>::EVENT_CLASS;
+
+    template <EVENT_ID EVENT>
+    using callback_type =
+        typename event_class<EVENT>::template context_callback_type<CONTEXT>;
+
+    using state_callback_type = typename _inner::Callback<CONTEXT>::type;
+
+    explicit StateMachineDefinition(
+        const std::string& name,
+        MemoryResource* resource = new_delete_resource())
+        : resource_(resource)
+        , states_(resource)
+        , ids_(resource)
+        , transitions_(resource)
+        , events_(resource) {
+        states_.push_back(
+            _inner::create<State>(resource, name, 0, nullptr, resource));
+    }
+
+    ~StateMachineDefinition() {
+        for (auto&& trans : transitions_) {
+            trans.second->destroy();
+        }
+
+        for (auto&& st : states_) {
+            _inner::destroy(resource_, st);
+        }
+    }
+
+    StateMachineDefinition(const StateMachineDefinition&) = delete;
+    StateMachineDefinition& operator=(const StateMachineDefinition&) = delete;
+
+    void create_states(STATE_ID parent, const std::list<STATE_ID>& states) {
+        for (auto&& s : states) {
+            create_state(state(parent), s);
+        }
+    }
+
+    void create_states(const std::list<STATE_ID>& states) {
+        for (auto&& s : states) {
+            create_state(states_.front(), s);
+        }
+    }
+
+    void set_parallel(bool is_par) { states_.front()->set_parallel(is_par); }
+
+    void set_parallel(STATE_ID st, bool is_par) {
+        state(st)->set_parallel(is_par);
+    }
+
+    void on_state_entered(STATE_ID st, state_callback_type fn) {
+        state(st)->on_entered(fn);
+    }
+
+    void on_state_exited(STATE_ID st, state_callback_type fn) {
+        state(st)->on_exited(fn);
+    }
+
+    template <EVENT_ID EVENT>
+    void add_transition(STATE_ID source) {
+        assert(transitions_.count({state(source), EVENT}) == 0);
+
+        auto tran = _inner::create<transition_type<EVENT>>(
+            resource_, state(source), nullptr, resource_);
+        transitions_[{state(source), EVENT}] = tran;
+        event_states(EVENT).sources.set(state(source)->index());
+    }
+
+    template <EVENT_ID EVENT>
+    void add_transition(STATE_ID source, STATE_ID target) {
+        assert(transitions_.count({state(source), EVENT}) == 0);
+
+        auto tran = _inner::create<transition_type<EVENT>>(
+            resource_, state(source), state(target), resource_);
+        transitions_[{state(source), EVENT}] = tran;
+        event_states(EVENT).sources.set(state(source)->index());
+    }
+
+    template <EVENT_ID EVENT>
+    void on_transition(STATE_ID source, callback_type<EVENT> fn) {
+        assert(transitions_.count({state(source), EVENT}) == 1);
+
+        auto trans = static_cast<transition_type<EVENT>*>(
+            transitions_[{state(source), EVENT}]);
+        trans->on_transition(fn);
+    }
+
+    // While `st` is active and no active state has a transition for EVENT,
+    // the event is kept by the machine. It is dispatched once an active
+    // state has a transition for it, and kept until then: unlike UML, a
+    // configuration which neither handles nor defers it doesn't discard it.
+    template <EVENT_ID EVENT>
+    void defer(STATE_ID st) {
+        event_states(EVENT).deferrers.set(state(st)->index());
+        has_deferrals_ = true;
+    }
+
+    size_t state_count() const { return states_.size(); }
+
+    MemoryResource* resource() const { return resource_; }
+
+private:
+    template <typename, typename>
+    friend struct StateMachine;
+    template <typename, typename>
+    friend class StateMachineInstance;
+    template <typename, typename>
+    friend class StateMachineGroup;
+
+    using State = _inner::State<CONTEXT>;
+    using Transition = _inner::Transition<CONTEXT>;
+    using Configuration = _inner::Configuration;
+
+    template <EVENT_ID EVENT>
+    using transition_type = _inner::TransitionImpl<event_class<EVENT>, CONTEXT>;
+
+    // states with a transition for an event, and states deferring it
+    struct EventStates {
+        explicit EventStates(MemoryResource* resource)
+            : sources(resource), deferrers(resource) {}
+
+        _inner::StateSet sources;
+        _inner::StateSet deferrers;
+    };
+
+    void start(Configuration& config, CONTEXT* ctx) const {
+        enter(config, states_.front(), nullptr, ctx);
+    }
+
+    bool is_active(const Configuration& config, STATE_ID st) const {
+        return config.test(state(st)->index());
+    }
+
+    // runs the transitions of the active configuration matching `ev`
+    void dispatch(Configuration& config, const _inner::Event<EVENT_ID>* ev,
+                  CONTEXT* ctx) const {
+        // the transitions are looked up in the configuration at the arrival
+        // of the event
+        uint64_t local[Configuration::stack_words];
+        auto count = config.word_count();
+        auto snapshot = count <= Configuration::stack_words ? local
+                                                            : config.scratch();
+        memcpy(snapshot, config.words(), count * sizeof(uint64_t));
+
+        walk(snapshot, states_.front(), [&](const State* st) {
+            auto it = transitions_.find({st, ev->type()});
+            if (it == transitions_.end()) return;
+
+            auto tr = it->second;
+            if (tr->target_state()) {
+                if (config.test(st->index())) {
+                    do_transition(config, ev, tr, ctx);
+                }
+            } else {
+                tr->do_callback(ev, ctx);
+            }
+        });
+    }
+
+    bool is_deferred(const Configuration& config, EVENT_ID ev) const {
+        if (!has_deferrals_) return false;
+
+        auto states = find_event_states(ev);
+        return states && states->deferrers.intersects(config) &&
+               !states->sources.intersects(config);
+    }
+
+    // Moves the events of `parked` which an active state has a transition
+    // for to `released`, in order. The others stay parked.
+    void release(const Configuration& config, _inner::EventQueue& parked,
+                 _inner::EventQueue& released) const {
+        _inner::EventQueue kept;
+        while (auto ev = parked.pop_front()) {
+            auto states = find_event_states(
+                static_cast<_inner::Event<EVENT_ID>*>(ev)->type());
+            if (states && states->sources.intersects(config)) {
+                released.push_back(ev);
+            } else {
+                kept.push_back(ev);
+            }
+        }
+        parked.splice_front(kept);
+    }
+
+    // Null when no state has a transition for `ev` nor defers it.
+    const EventStates* find_event_states(EVENT_ID ev) const {
+        auto it = events_.find(ev);
+        return it != events_.end() ? &it->second : nullptr;
+    }
+
+    // Whether an active state of `config` has a transition for the event
+    // of `states`, or defers it: a few word tests, no dispatch.
+    static bool is_expected(const Configuration& config,
+                            const EventStates* states) {
+        return states && (states->sources.intersects(config) ||
+                          states->deferrers.intersects(config));
+    }
+
+    EventStates& event_states(EVENT_ID ev) {
+        auto it = events_.find(ev);
+        if (it == events_.end()) {
+            it = events_.emplace(ev, EventStates(resource_)).first;
+        }
+        return it->second;
+    }
+
+    // visits the active states of `config`, innermost first
+    template <typename FN>
+    void walk(const uint64_t* config, const State* st, FN&& fn) const {
+        if (!Configuration::test(config, st->index())) {
+            return;
+        }
+
+        for (auto&& child : st->children()) {
+            walk(config, child, fn);
+        }
+
+        fn(st);
+    }
+
+    void enter(Configuration& config, const State* st,
+               const _inner::EventBase* event, CONTEXT* ctx) const {
+        assert(!config.test(st->index()));
+
+        if (st->parent()) enter_ancestor(config, st->parent(), event, ctx);
+
+        activate(config, st, event, ctx);
+
+        if (st->is_parallel()) {
+            for (auto&& child : st->children()) {
+                enter(config, child, event, ctx);
+            }
+        } else {
+            if (!st->children().empty()) {
+                enter(config, st->children().front(), event, ctx);
+            }
+        }
+    }
+
+    void enter_ancestor(Configuration& config, const State* st,
+                        const _inner::EventBase* event, CONTEXT* ctx) const {
+        if (config.test(st->index())) return;
+
+        // FIXME: Error when having parallel states.
+
+        if (st->parent()) enter_ancestor(config, st->parent(), event, ctx);
+
+        activate(config, st, event, ctx);
+    }
+
+    void activate(Configuration& config, const State* st,
+                  const _inner::EventBase* event, CONTEXT* ctx) const {
+        log("enter state: %s", st->name());
+        config.set(st->index());
+
+        st->do_enter_callback(event, ctx);
+    }
+
+    void exit(Configuration& config, const State* st,
+              const _inner::EventBase* event, CONTEXT* ctx) const {
+        assert(config.test(st->index()));
+
+        // the active child, or every child of a parallel state
+        for (auto&& child : st->children()) {
+            if (config.test(child->index())) {
+                exit(config, child, event, ctx);
+            }
+        }
+
+        log("exit state: %s", st->name());
+        config.reset(st->index());
+
+        st->do_exit_callback(event, ctx);
+    }
+
+    void do_transition(Configuration& config,
+                       const _inner::Event<EVENT_ID>* ev,
+                       const Transition* trans, CONTEXT* ctx) const {
+        auto source = trans->source_state();
+        auto target = trans->target_state();
+
+        assert(source);
+        if (source == target) {
+            exit(config, source, ev, ctx);
+            trans->do_callback(ev, ctx);
+
+            enter(config, target, ev, ctx);
+            return;
+        }
+
+        const State* prev_s = nullptr;
+        for (const State* s = source; s != nullptr; s = s->parent()) {
+            for (const State* t = target; t != nullptr; t = t->parent()) {
+                if (s == t) {
+                    if (prev_s) {
+                        exit(config, prev_s, ev, ctx);
+                    }
+
+                    trans->do_callback(ev, ctx);
+
+                    enter(config, target, ev, ctx);
+                    return;
+                }
+            }
+            prev_s = s;
+        }
+
+        return;  // don't reach
+    }
+
+    State* state(STATE_ID st) const {
+        auto it = ids_.find(st);
+        assert(it != ids_.end());
+        return it->second;
+    }
 
-public:
-    using callback_type = std::function<void()>;
-    static const EVENT_ENUM event_type = EVENT;
+    void create_state(State* parent, STATE_ID child) {
+        assert(ids_.count(child) == 0);
 
-    static EventImpl* create() { return new EventImpl(); }
+        auto st = _inner::create<State>(resource_, to_string(child),
+                                        states_.size(), parent, resource_);
+        states_.push_back(st);
+        ids_[child] = st;
+    }
 
-    void exec(callback_type fn) { fn(); }
+private:
+    MemoryResource* resource_;
+    _inner::Vector<State*> states_;  // indexed by state index, root first
+    _inner::Map<STATE_ID, State*> ids_;
+    _inner::Map<std::pair<const State*, EVENT_ID>, Transition*> transitions_;
+    _inner::Map<EVENT_ID, EventStates> events_;
+    bool has_deferrals_ = false;
 };
 
-template <typename EVENT_ENUM, EVENT_ENUM EVENT, typename DATATYPE>
-class EventImplWithData : public Event<EVENT_ENUM> {
-    EventImplWithData(const DATATYPE& data)
-        : Event<EVENT_ENUM>(EVENT), data(data) {}
-
+// Machine built from a shared StateMachineDefinition. An instance only holds
+// its active configuration and the events sent to it while it dispatches,
+// so it is cheap to create by the thousand.
+//
+// Events are dispatched on the calling thread: an instance is not thread
+// safe. Events sent from its own callbacks are queued and dispatched after
+// the current one (run to completion).
+//
+// `CONTEXT` is the type passed to the callbacks. To keep per-machine data,
+// derive from the instance and pass the derived class:
+//
+//   struct Session : StateMachineInstance<Policy, Session> { ... };
+template <typename STATE_POLICY, typename CONTEXT = void>
+class StateMachineInstance {
 public:
-    const DATATYPE data;
-    using callback_type = std::function<void(DATATYPE)>;
-    static const EVENT_ENUM event_type = EVENT;
+    using STATE_ID = typename STATE_POLICY::STATE;
+    using EVENT_ID = typename STATE_POLICY::EVENT;
 
-    static EventImplWithData* create(const DATATYPE& data) {
-        return new EventImplWithData(data);
+    using context_type =
+        typename std::conditional<std::is_void<CONTEXT>::value,
+                                  StateMachineInstance, CONTEXT>::type;
+    using definition_type = StateMachineDefinition<STATE_POLICY, context_type>;
+
+    template <EVENT_ID EVENT>
+    using event_class = typename definition_type::template event_class<EVENT>;
+
+    // `definition` must be complete, and outlive the instance. Events are
+    // allocated from `event_resource` (`resource` when null), which should
+    // recycle memory.
+    explicit StateMachineInstance(
+        const definition_type& definition,
+        MemoryResource* resource = new_delete_resource(),
+        MemoryResource* event_resource = nullptr)
+        : definition_(&definition)
+        , resource_(resource)
+        , event_resource_(event_resource ? event_resource : resource)
+        , config_(definition.state_count(), resource) {}
+
+    ~StateMachineInstance() {
+        ready_.clear();
+        queue_.clear();
+        deferred_.clear();
+        config_.release(resource_);
     }
 
-    void exec(callback_type fn) { fn(data); }
-};
+    StateMachineInstance(const StateMachineInstance&) = delete;
+    StateMachineInstance& operator=(const StateMachineInstance&) = delete;
 
-template <typename EVENT, typename EVENT_ENUM>
-inline EVENT* event_cast(Event<EVENT_ENUM>* ev) {
-    if (ev->EventType() == static_cast<EVENT_ENUM>(EVENT::event_type)) {
-        return static_cast<EVENT*>(ev);
+    // enters the initial configuration
+    void start() {
+        run([this] { definition_->start(config_, context()); });
     }
 
-    return nullptr;
-}
+    template <EVENT_ID E, typename... Args>
+    void send(Args&&... args) {
+        auto event = event_class<E>::create(event_resource_,
+                                            std::forward<Args>(args)...);
+        queue_.push_back(event);
 
-struct State {
-    State(const std::string& name, State* parent = nullptr)
-        : name_(name), parent_(parent) {
-        if (parent) {
-            parent->add_child(this);
-        }
+        if (!dispatching_) run([] {});
     }
 
-    virtual ~State() {
-        for (auto&& child : children_) {
-            delete child;
-        }
+    bool is_active(STATE_ID st) const {
+        return definition_->is_active(config_, st);
     }
 
-    void enter(EventBase* event) {
-        assert(!is_active_);
+    const definition_type& definition() const { return *definition_; }
 
-        if (parent_) parent_->enter_child(event, this);
+private:
+    context_type* context() { return static_cast<context_type*>(this); }
 
-        log("enter state: %s", name_.c_str());
-        is_active_ = true;
+    template <typename FN>
+    void run(FN fn) {
+        assert(!dispatching_);
+        dispatching_ = true;
 
-        do_enter_callback(event);
+        fn();
 
-        if (is_parallel_) {
-            for (auto&& child : children_) {
-                child->enter(event);
+        // released deferred events first
+        while (auto ev = static_cast<_inner::Event<EVENT_ID>*>(
+                   ready_.empty() ? queue_.pop_front() : ready_.pop_front())) {
+            if (definition_->is_deferred(config_, ev->type())) {
+                deferred_.push_back(ev);
+                continue;
             }
-            active_child_ = nullptr;
-        } else {
-            if (!children_.empty()) {
-                active_child_ = children_.front();
-                active_child_->enter(event);
+
+            auto holder =
+                std::unique_ptr<_inner::Event<EVENT_ID>, _inner::Deleter>(ev);
+            auto generation = config_.generation();
+            definition_->dispatch(config_, holder.get(), context());
+
+            if (config_.generation() != generation && !deferred_.empty()) {
+                _inner::EventQueue released;
+                definition_->release(config_, deferred_, released);
+                ready_.splice_back(released);
             }
         }
+
+        dispatching_ = false;
     }
 
-    void exit(EventBase* event) {
-        assert(is_active_);
+    const definition_type* definition_;
+    MemoryResource* resource_;
+    MemoryResource* event_resource_;
+    _inner::Configuration config_;
+    _inner::EventQueue queue_;
+    _inner::EventQueue deferred_;
+    _inner::EventQueue ready_;  // released deferred events
+    bool dispatching_ = false;
+};
 
-        if (active_child_) {
-            active_child_->exit(event);
-            active_child_ = nullptr;
-        }
+// Wakes up a callback on the thread running its backend. `send()` may be
+// called from any thread; sends are coalesced until the callback runs.
+class Wakeup {
+public:
+    virtual ~Wakeup() {}
 
-        if (is_parallel_) {
-            for (auto&& child : children_) {
-                assert(child->is_active());
-                child->exit(event);
-            }
-        }
+    virtual void start() = 0;
+    virtual void stop() = 0;
+    virtual void send() = 0;
 
-        log("exit state: %s", name_.c_str());
-        is_active_ = false;
+    // releases the wakeup to the resource it was allocated from
+    virtual void destroy() = 0;
+};
 
-        do_exit_callback(event);
-    }
+// Runs a callback on the thread running the backend whenever a file
+// descriptor is readable.
+class FdWatcher {
+public:
+    virtual ~FdWatcher() {}
 
-    void walk(std::function<void(State*)> fn) {
-        if (!is_active_) {
-            return;
-        }
+    virtual void start() = 0;
+    virtual void stop() = 0;
 
-        if (active_child_) {
-            active_child_->walk(fn);
-        }
+    // releases the watcher to the resource it was allocated from
+    virtual void destroy() = 0;
+};
 
-        fn(this);
+// Event loop integration of StateMachine and StateMachineGroup.
+class Backend {
+public:
+    virtual ~Backend() {}
+
+    // The returned wakeup is allocated from `resource` and must be released
+    // with `destroy()` on the thread running the backend.
+    virtual Wakeup* create_wakeup(std::function<void()> fn,
+                                  MemoryResource* resource) = 0;
+
+    // Same as `create_wakeup()` for readiness of `fd`. Returns nullptr when
+    // the backend can't watch descriptors.
+    virtual FdWatcher* create_fd_watcher(int fd, std::function<void()> fn,
+                                         MemoryResource* resource) {
+        (void)fd;
+        (void)fn;
+        (void)resource;
+        return nullptr;
     }
 
-    const bool is_active() const { return is_active_; }
+    // the loop running the callbacks, shared by backends which wrap it
+    virtual const void* loop_id() const { return this; }
 
-    const State* parent() const { return parent_; }
-    State* parent() { return parent_; }
+    // True when the thread running the backend polls its wakeups in a loop:
+    // a callback sending its own wakeup again then runs on every iteration.
+    virtual bool spins() const { return false; }
+};
 
-    const std::string name() { return name_; }
+#ifndef SEEDSM_NO_LIBEV
+// Wakeups are `ev::async` watchers on a libev loop.
+class LibevBackend : public Backend {
+public:
+    explicit LibevBackend(ev::loop_ref loop) : loop_(loop) {}
 
-    void on_entered(std::function<void()> fn) {
-        on_entered_callbacks_.push_back(fn);
-    }
+#if EV_MULTIPLICITY
+    const void* loop_id() const override { return loop_.raw_loop; }
+#else
+    const void* loop_id() const override { return nullptr; }  // the only one
+#endif
 
-    void on_exited(std::function<void()> fn) {
-        on_exited_callbacks_.push_back(fn);
+    Wakeup* create_wakeup(std::function<void()> fn,
+                          MemoryResource* resource) override {
+        return _inner::create<AsyncWakeup>(resource, loop_, std::move(fn),
+                                           resource);
     }
 
-    void set_parallel(bool is_par) {
-        assert(!is_active_);
-        is_parallel_ = is_par;
+    FdWatcher* create_fd_watcher(int fd, std::function<void()> fn,
+                                 MemoryResource* resource) override {
+        return _inner::create<IoWatcher>(resource, loop_, fd, std::move(fn),
+                                         resource);
     }
 
-    bool is_parallel() const { return is_parallel_; }
+    ev::loop_ref loop() const { return loop_; }
 
 private:
-    void add_child(State* child) {
-        if (!child) return;
+    class AsyncWakeup : public Wakeup {
+    public:
+        AsyncWakeup(ev::loop_ref loop, std::function<void()> fn,
+                    MemoryResource* resource)
+            : watcher_(loop), fn_(std::move(fn)), resource_(resource) {
+            watcher_.set<AsyncWakeup, &AsyncWakeup::fired>(this);
+        }
 
-        children_.push_back(child);
-    }
+        void start() override { watcher_.start(); }
+        void stop() override { watcher_.stop(); }
+        void send() override { watcher_.send(); }
 
-    void do_enter_callback(EventBase* event) {
-        for (auto& fn : on_entered_callbacks_) {
-            fn();
-        }
-    }
+        void destroy() override { _inner::destroy(resource_, this); }
 
-    void do_exit_callback(EventBase* event) {
-        for (auto& fn : on_exited_callbacks_) {
-            fn();
+    private:
+        void fired() { fn_(); }
+
+        ev::async watcher_;
+        std::function<void()> fn_;
+        MemoryResource* resource_;
+    };
+
+    class IoWatcher : public FdWatcher {
+    public:
+        IoWatcher(ev::loop_ref loop, int fd, std::function<void()> fn,
+                  MemoryResource* resource)
+            : watcher_(loop), fn_(std::move(fn)), resource_(resource) {
+            watcher_.set<IoWatcher, &IoWatcher::fired>(this);
+            watcher_.set(fd, ev::READ);
         }
-    }
 
-    void enter_child(EventBase* event, State* child) {
-        active_child_ = child;
+        void start() override { watcher_.start(); }
+        void stop() override { watcher_.stop(); }
 
-        if (is_active_) return;
+        void destroy() override { _inner::destroy(resource_, this); }
 
-        // FIXME: Error when having parallel states.
+    private:
+        void fired() { fn_(); }
+
+        ev::io watcher_;
+        std::function<void()> fn_;
+        MemoryResource* resource_;
+    };
+
+    ev::loop_ref loop_;
+};
+#endif
 
-        if (parent_) parent_->enter_child(event, this);
+// Runs the callbacks of sent wakeups only when the host calls `poll()`.
+// Lets machines be driven from any event loop, or from none at all.
+class ManualBackend : public Backend {
+public:
+    explicit ManualBackend(MemoryResource* resource = new_delete_resource())
+        : pending_(resource), running_(resource) {}
 
-        log("enter state: %s", name_.c_str());
+    ManualBackend(const ManualBackend&) = delete;
+    ManualBackend& operator=(const ManualBackend&) = delete;
 
-        is_active_ = true;
-        do_enter_callback(event);
+    Wakeup* create_wakeup(std::function<void()> fn,
+                          MemoryResource* resource) override {
+        return _inner::create<PendingWakeup>(resource, this, std::move(fn),
+                                             resource);
     }
 
-private:
-    std::string name_;
-    State* parent_;
-    bool is_active_ = false;
-    std::list<State*> children_;
-    State* active_child_ = nullptr;  // not used in parallel state
-    bool is_parallel_ = false;
+    // Runs the callbacks of the started wakeups sent since the previous
+    // call and returns how many ran. Must always be called from the same
+    // thread.
+    size_t poll() {
+        if (!scheduled_.load(std::memory_order_acquire)) return 0;
 
-    std::list<std::function<void()>> on_entered_callbacks_;
-    std::list<std::function<void()>> on_exited_callbacks_;
-};
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            std::swap(pending_, running_);
+            scheduled_.store(false, std::memory_order_relaxed);
+        }
 
-struct Transition {
-    Transition(State* source = nullptr, State* target = nullptr)
-        : source_(source), target_(target) {}
+        size_t count = 0;
+        for (size_t i = 0; i < running_.size(); ++i) {
+            auto w = running_[i];
+            if (!w) continue;  // destroyed by a previous callback
 
-    // virtual bool event_test(Event* ev) = 0;
+            w->pending_.store(false);
+            if (w->is_active_) {
+                w->fn_();
+                ++count;
+            }
+        }
+        running_.clear();
 
-    virtual ~Transition() {}
+        return count;
+    }
+
+    bool has_pending() const {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return !pending_.empty();
+    }
 
-    State* source_state() { return source_; }
-    const State* source_state() const { return source_; }
+    // number of started wakeups
+    size_t active() const { return active_.load(); }
 
-    State* target_state() { return target_; }
-    const State* target_state() const { return target_; }
+    // number of `notify()` calls, i.e. wakeups of an idle backend
+    uint64_t notify_count() const { return notify_count_; }
 
-    virtual void do_callback(EventBase* ev) = 0;
+protected:
+    // Called with the pending list locked when it stops being empty.
+    virtual void notify() {}
 
 private:
-    State* source_;
-    State* target_;
-};
+    class PendingWakeup : public Wakeup {
+    public:
+        PendingWakeup(ManualBackend* backend, std::function<void()> fn,
+                      MemoryResource* resource)
+            : backend_(backend), fn_(std::move(fn)), resource_(resource) {}
+
+        void start() override {
+            if (is_active_) return;
+            is_active_ = true;
+            backend_->active_++;
+        }
 
-template <typename EVENT_CLASS>
-struct TransitionImpl : public Transition {
-    explicit TransitionImpl(State* source = nullptr, State* target = nullptr)
-        : Transition(source, target), func_list_() {}
+        void stop() override {
+            if (!is_active_) return;
+            is_active_ = false;
+            backend_->active_--;
+        }
 
-    void on_transition(typename EVENT_CLASS::callback_type fn) {
-        func_list_.push_back(fn);
-    }
+        void send() override {
+            if (pending_.exchange(true)) return;
+            backend_->schedule(this);
+        }
 
-    void on_transition_failed(typename EVENT_CLASS::callback_type fn) {
-        failed_func_list_.push_back(fn);
-    }
+        void destroy() override {
+            stop();
+            backend_->cancel(this);
+            _inner::destroy(resource_, this);
+        }
 
-protected:
-    // bool event_test(Event* ev) override {
-    //     auto event = static_cast<EVENT_CLASS*>(ev);
-    //     if (event->type() != EVENT_CLASS::event_type) return false;
+    private:
+        friend class ManualBackend;
 
-    //     return true;
-    // }
+        ManualBackend* backend_;
+        std::function<void()> fn_;
+        MemoryResource* resource_;
+        std::atomic<bool> pending_{false};
+        bool is_active_ = false;
+    };
 
-    void do_callback(EventBase* ev) override {
-        for (auto fn : func_list_) {
-            auto event = static_cast<EVENT_CLASS*>(ev);
-            event->exec(fn);
+    void schedule(PendingWakeup* w) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        pending_.push_back(w);
+        if (pending_.size() == 1) {
+            scheduled_.store(true, std::memory_order_release);
+            ++notify_count_;
+            notify();
         }
     }
 
-private:
-    std::list<typename EVENT_CLASS::callback_type> func_list_;
-    std::list<typename EVENT_CLASS::callback_type> failed_func_list_;
+    void cancel(PendingWakeup* w) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        pending_.erase(std::remove(pending_.begin(), pending_.end(), w),
+                       pending_.end());
+        std::replace(running_.begin(), running_.end(), w,
+                     static_cast<PendingWakeup*>(nullptr));
+    }
+
+    mutable std::mutex mutex_;
+    _inner::Vector<PendingWakeup*> pending_;
+    _inner::Vector<PendingWakeup*> running_;  // only touched by poll()
+    std::atomic<bool> scheduled_{false};  // pending_ is not empty
+    std::atomic<size_t> active_{0};
+    uint64_t notify_count_ = 0;
 };
-}  // _inner
 
-template <typename STATE_POLICY>
-struct StateMachine : protected _inner::State {
+template <typename STATE_POLICY, typename CONTEXT = void>
+class StateMachineGroup;
+
+template <typename STATE_POLICY, typename CONTEXT = void>
+class ShmReceiver;
+
+// Machine dispatching its events on the loop of a Backend.
+//
+// `CONTEXT` is the type passed to the callbacks of its definition, the
+// machine itself when void. To reach per-machine data from a shared
+// definition, derive from the machine and pass the derived class:
+//
+//   struct Session : StateMachine<Policy, Session> { ... };
+template <typename STATE_POLICY, typename CONTEXT = void>
+struct StateMachine {
     using STATE_ID = typename STATE_POLICY::STATE;
     using EVENT_ID = typename STATE_POLICY::EVENT;
 
@@ -327,49 +1714,111 @@ struct StateMachine : protected _inner::State {
     using event_class = typename _EventCreator<
         decltype(EVENT), static_cast<int>(EVENT)>::EVENT_CLASS;
 
-    StateMachine(const std::string& name, ev::loop_ref loop)
-        : State(name)
-        , loop_(loop)
-        , states_()
-        , send_event_(std::unique_ptr<ev::async>(new ev::async(loop)))
-        , init_event_(std::unique_ptr<ev::async>(new ev::async(loop))) {
-        send_event_->set<StateMachine, &StateMachine::received>(this);
-        init_event_->set<StateMachine, &StateMachine::initialize>(this);
+    using context_type =
+        typename std::conditional<std::is_void<CONTEXT>::value, StateMachine,
+                                  CONTEXT>::type;
+    using definition_type = StateMachineDefinition<STATE_POLICY, context_type>;
+
+#ifndef SEEDSM_NO_LIBEV
+    StateMachine(const std::string& name, ev::loop_ref loop,
+                 MemoryResource* resource = new_delete_resource(),
+                 MemoryResource* event_resource = nullptr)
+        : StateMachine(name, *_inner::create<LibevBackend>(resource, loop),
+                       resource, event_resource) {
+        owns_backend_ = true;
+    }
+
+    StateMachine(const definition_type& definition, ev::loop_ref loop,
+                 MemoryResource* resource = new_delete_resource(),
+                 MemoryResource* event_resource = nullptr)
+        : StateMachine(definition,
+                       *_inner::create<LibevBackend>(resource, loop),
+                       resource, event_resource) {
+        owns_backend_ = true;
+    }
+#endif
+
+    // The definition, configuration and wakeups are allocated from
+    // `resource`, on the loop thread. Events are allocated from
+    // `event_resource` (`resource` when null) by the sending thread and
+    // released by the loop thread: it must be thread safe if events are
+    // sent from other threads, and should recycle memory. Both resources
+    // and `backend` must outlive the machine.
+    //
+    // E.g. a MonotonicBufferResource per machine, or per loop, for the
+    // rest, with a SynchronizedPoolResource for events.
+    StateMachine(const std::string& name, Backend& backend,
+                 MemoryResource* resource = new_delete_resource(),
+                 MemoryResource* event_resource = nullptr)
+        : StateMachine(*_inner::create<definition_type>(resource, name,
+                                                        resource),
+                       backend, resource, event_resource) {
+        owned_definition_ = const_cast<definition_type*>(definition_);
     }
 
+    // Machine running a definition shared with other machines, which must
+    // be complete and outlive it. The machine only holds its configuration,
+    // queues and wakeups, and can't be modified by the methods building a
+    // definition (`create_states()`, `add_transition()`...).
+    StateMachine(const definition_type& definition, Backend& backend,
+                 MemoryResource* resource = new_delete_resource(),
+                 MemoryResource* event_resource = nullptr)
+        : resource_(resource)
+        , event_resource_(event_resource ? event_resource : resource)
+        , backend_(&backend)
+        , definition_(&definition)
+        , init_event_(backend.create_wakeup([this] { initialize(); },
+                                            resource))
+        , send_event_(backend.create_wakeup([this] { received(); },
+                                            resource))
+        , groups_(resource) {}
+
     ~StateMachine() {
-        for (auto&& trans : transitions_) {
-            delete trans.second;
+        while (!groups_.empty()) {
+            groups_.front()->remove(this);
         }
 
-        for (auto&& ev : event_queue_) {
-            delete ev;
+        init_event_.reset();
+        send_event_.reset();
+#ifndef SEEDSM_NO_LIBEV
+        if (owns_backend_) {
+            _inner::destroy(resource_, static_cast<LibevBackend*>(backend_));
         }
+#endif
 
-        for (auto&& ev : high_event_queue_) {
-            delete ev;
+        config_.release(resource_);
+        published_.release(resource_);
+
+        ready_.clear();
+        deferred_.clear();
+        event_queue_.clear();
+        high_event_queue_.clear();
+
+        if (owned_definition_) {
+            _inner::destroy(resource_, owned_definition_);
         }
     }
 
     void create_states(STATE_ID parent, const std::list<STATE_ID>& states) {
-        for (auto&& s : states) {
-            create_state(id_to_state(parent), s);
-        }
+        own_definition().create_states(parent, states);
     }
 
     void create_states(const std::list<STATE_ID>& states) {
-        for (auto&& s : states) {
-            create_state(this, s);
-        }
+        own_definition().create_states(states);
     }
 
-    void set_parallel(bool is_par) { this->set_parallel(is_par); }
+    void set_parallel(bool is_par) { own_definition().set_parallel(is_par); }
 
     void set_parallel(STATE_ID st, bool is_par) {
-        state(st)->set_parallel(is_par);
+        own_definition().set_parallel(st, is_par);
     }
 
+    // `start()` and `stop()` must be called on the loop thread. A stopped
+    // machine dispatches nothing, including group broadcasts.
     void start() {
+        running_ = true;
+        initialized_ = false;
+
         init_event_->start();
         init_event_->send();
 
@@ -377,59 +1826,150 @@ struct StateMachine : protected _inner::State {
     }
 
     void stop() {
+        running_ = false;
+
         send_event_->stop();
         init_event_->stop();
     }
 
+    // Limits the events dispatched by one wakeup, so that a busy machine
+    // yields to the other watchers of its loop. Remaining events are
+    // dispatched on the next wakeup. Zero means unlimited.
+    void set_dispatch_budget(
+        size_t max_events,
+        std::chrono::nanoseconds max_time = std::chrono::nanoseconds::zero()) {
+        budget_events_ = max_events;
+        budget_time_ = max_time;
+    }
+
+    // number of wakeups which ended on the dispatch budget
+    uint64_t budget_exhausted_count() const {
+        return budget_exhausted_count_.load(std::memory_order_relaxed);
+    }
+
     template <EVENT_ID E, typename... Args>
     void send(Args&&... args) {
-        auto event = event_class<E>::create(std::forward<Args>(args)...);
+        auto event = event_class<E>::create(event_resource_,
+                                            std::forward<Args>(args)...);
         post_event(event);
     }
 
     template <EVENT_ID E, typename... Args>
     void send_high(Args&&... args) {
-        auto event = event_class<E>::create(std::forward<Args>(args)...);
+        auto event = event_class<E>::create(event_resource_,
+                                            std::forward<Args>(args)...);
         post_high_event(event);
     }
 
     void on_state_entered(STATE_ID st, std::function<void()> fn) {
-        state(st)->on_entered(fn);
+        own_definition().on_state_entered(
+            st, _inner::ignore_context<context_type>(fn));
     }
 
     void on_state_exited(STATE_ID st, std::function<void()> fn) {
-        state(st)->on_exited(fn);
+        own_definition().on_state_exited(
+            st, _inner::ignore_context<context_type>(fn));
     }
 
     template <EVENT_ID EVENT>
     void add_transition(STATE_ID source) {
-        assert(transitions_.count({state(source), EVENT}) == 0);
-
-        auto tran = new _inner::TransitionImpl<event_class<EVENT>>(
-            state(source), nullptr);
-        transitions_[{state(source), EVENT}] = tran;
+        own_definition().template add_transition<EVENT>(source);
     }
 
     template <EVENT_ID EVENT>
     void add_transition(STATE_ID source, STATE_ID target) {
-        assert(transitions_.count({state(source), EVENT}) == 0);
-
-        auto tran = new _inner::TransitionImpl<event_class<EVENT>>(
-            state(source), state(target));
-        transitions_[{state(source), EVENT}] = tran;
+        own_definition().template add_transition<EVENT>(source, target);
     }
 
     template <EVENT_ID EVENT>
     void on_transition(STATE_ID source,
                        typename event_class<EVENT>::callback_type fn) {
-        assert(transitions_.count({state(source), EVENT}) == 1);
+        own_definition().template on_transition<EVENT>(
+            source, _inner::ignore_context<context_type>(fn));
+    }
 
-        auto trans = static_cast<_inner::TransitionImpl<event_class<EVENT>>*>(
-            transitions_[{state(source), EVENT}]);
-        trans->on_transition(fn);
+    // Parks the events of type EVENT sent while `st` is active and can't
+    // handle them. Parked events are released in their original order,
+    // ahead of the queue, once an active state has a transition for them.
+    // Until then they stay parked, even in configurations which don't defer
+    // them (UML would discard them). Broadcast events are parked by
+    // reference.
+    template <EVENT_ID EVENT>
+    void defer(STATE_ID st) {
+        own_definition().template defer<EVENT>(st);
+    }
+
+    MemoryResource* resource() const { return resource_; }
+
+    MemoryResource* event_resource() const { return event_resource_; }
+
+    const definition_type& definition() const { return *definition_; }
+
+    // Copy of the active configuration, which may be taken from any thread.
+    class Snapshot {
+    public:
+        bool is_in(STATE_ID st) const {
+            auto index = definition_->state(st)->index();
+            return index / 64 < count_ &&
+                   _inner::Configuration::test(words(), index);
+        }
+
+        // calls `fn(STATE_ID)` for every active state
+        template <typename FN>
+        void for_each_active(FN fn) const {
+            for (auto&& id : definition_->ids_) {
+                if (is_in(id.first)) fn(id.first);
+            }
+        }
+
+    private:
+        friend struct StateMachine;
+
+        explicit Snapshot(const definition_type* def) : definition_(def) {}
+
+        const uint64_t* words() const {
+            return heap_.empty() ? local_ : heap_.data();
+        }
+
+        const definition_type* definition_;
+        uint64_t local_[4] = {};
+        std::vector<uint64_t> heap_;
+        size_t count_ = 0;
+    };
+
+    // The following may be called from any thread. They read the
+    // configuration published at the end of the last run-to-completion
+    // step, without locking nor waking the machine.
+    bool is_in(STATE_ID st) const {
+        return published_.test(definition_->state(st)->index());
+    }
+
+    Snapshot snapshot() const {
+        Snapshot s(definition_);
+        auto count = published_.word_count();
+        uint64_t* words = s.local_;
+        if (count > 4) {
+            s.heap_.resize(count);
+            words = s.heap_.data();
+        }
+        s.count_ = published_.load(words, count);
+        return s;
     }
 
 private:
+    friend class StateMachineGroup<STATE_POLICY, CONTEXT>;
+    friend class ShmReceiver<STATE_POLICY, CONTEXT>;
+
+    using event_ptr =
+        std::unique_ptr<_inner::Event<EVENT_ID>, _inner::Deleter>;
+
+    context_type* context() { return static_cast<context_type*>(this); }
+
+    definition_type& own_definition() {
+        assert(owned_definition_ && "the definition is shared");
+        return *owned_definition_;
+    }
+
     void post_event(_inner::EventBase* ev) {
         std::unique_lock<std::mutex> lock(queue_mutex_);
         event_queue_.push_back(ev);
@@ -444,142 +1984,300 @@ private:
 
     _inner::EventBase* pop_event() {
         std::unique_lock<std::mutex> lock(queue_mutex_);
-        if (!high_event_queue_.empty()) {
-            auto ev = high_event_queue_.front();
-            high_event_queue_.pop_front();
-            return ev;
-        }
-
-        if (event_queue_.empty()) return nullptr;
+        if (!high_event_queue_.empty()) return high_event_queue_.pop_front();
 
-        auto ev = event_queue_.front();
-        event_queue_.pop_front();
-        return ev;
+        return event_queue_.pop_front();
     }
 
-    const std::list<_inner::Transition*> collect_transition(EVENT_ID ev) {
-        std::list<_inner::Transition*> trans;
-
-        walk([this, ev, &trans](_inner::State* st) {
-            if (transitions_.count({st, ev}) > 0) {
-                trans.push_back(transitions_[{st, ev}]);
-            }
-        });
+    bool has_event() {
+        if (!ready_.empty()) return true;
 
-        return trans;
+        std::unique_lock<std::mutex> lock(queue_mutex_);
+        return !high_event_queue_.empty() || !event_queue_.empty();
     }
 
-    bool is_active(_inner::State* state) {
-        bool active = false;
-        walk([this, &active, state](_inner::State* st) {
-            if (state == st) {
-                active = true;
+    void received() {
+        using clock = std::chrono::steady_clock;
+
+        auto timed = budget_time_ > std::chrono::nanoseconds::zero();
+        auto deadline =
+            timed ? clock::now() + budget_time_ : clock::time_point();
+
+        initialize();
+
+        receiving_ = true;
+        for (size_t count = 0;; ++count) {
+            if (count > 0 && ((budget_events_ && count >= budget_events_) ||
+                              (timed && clock::now() >= deadline))) {
+                if (has_event()) {
+                    budget_exhausted_count_.fetch_add(
+                        1, std::memory_order_relaxed);
+                    send_event_->send();
+                }
+                break;
             }
-        });
 
-        return active;
-    }
+            // released deferred events first
+            auto ev = event_ptr(static_cast<_inner::Event<EVENT_ID>*>(
+                ready_.empty() ? pop_event() : ready_.pop_front()));
+            if (!ev) break;
 
-    void do_transition(_inner::EventBase* ev, _inner::State* source,
-                       _inner::State* target) {
-        assert(source);
-        if (source == target) {
-            source->exit(ev);
-            auto event = static_cast<_inner::Event<EVENT_ID>*>(ev);
-            auto trans = transitions_[{source, event->type()}];
-            trans->do_callback(ev);
+            deliver(std::move(ev));
+        }
+        receiving_ = false;
+    }
 
-            target->enter(ev);
+    // Dispatches `ev`, or parks it while the active states defer it.
+    void deliver(event_ptr ev) {
+        if (definition_->is_deferred(config_, ev->type())) {
+            deferred_.push_back(ev.release());
             return;
         }
 
-        _inner::State* prev_s = nullptr;
-        for (_inner::State* s = source; s != nullptr; s = s->parent()) {
-            for (_inner::State* t = target; t != nullptr; t = t->parent()) {
-                if (s == t) {
-                    if (prev_s) {
-                        prev_s->exit(ev);
-                    }
-
-                    auto event = static_cast<_inner::Event<EVENT_ID>*>(ev);
-                    auto trans = transitions_[{source, event->type()}];
-                    trans->do_callback(ev);
+        dispatch(ev->target());
+    }
 
-                    target->enter(ev);
-                    return;
-                }
-            }
-            prev_s = s;
+    // Same as above for an event shared with other machines.
+    void deliver(const std::shared_ptr<const _inner::Event<EVENT_ID>>& ev) {
+        if (definition_->is_deferred(config_, ev->type())) {
+            deferred_.push_back(
+                _inner::create<_inner::SharedEventRef<EVENT_ID>>(
+                    event_resource_, ev, event_resource_));
+            return;
         }
 
-        return;  // don't reach
+        dispatch(ev.get());
     }
 
-    void received() {
-        for (;;) {
-            auto ev = std::unique_ptr<_inner::Event<EVENT_ID>>(
-                static_cast<_inner::Event<EVENT_ID>*>(pop_event()));
-            if (!ev) return;
+    void dispatch(const _inner::Event<EVENT_ID>* ev) {
+        auto generation = config_.generation();
+        definition_->dispatch(config_, ev, context());
+        if (config_.generation() == generation) return;
 
-            auto ev_type = ev->type();
-            auto trans = collect_transition(ev_type);
+        published_.publish(config_);
 
-            for (auto&& tr : trans) {
-                auto source = tr->source_state();
-                auto target = tr->target_state();
+        if (!deferred_.empty()) {
+            _inner::EventQueue released;
+            definition_->release(config_, deferred_, released);
+            if (released.empty()) return;
 
-                if (target) {
-                    if (is_active(source)) {
-                        do_transition(ev.get(), source, target);
-                    }
-                } else {
-                    tr->do_callback(ev.get());
-                }
-            }
+            // behind the events released earlier, to keep their order
+            ready_.splice_back(released);
+            if (!receiving_) send_event_->send();
         }
     }
 
+    // Enters the initial configuration once per `start()`. Called before
+    // delivering any event: the wakeups of a loop, and those of a group or
+    // a receiver, may run before the init wakeup.
     void initialize() {
+        if (initialized_) return;
+        initialized_ = true;
+
         log("initialize");
 
-        enter(nullptr);
+        // the states are known once the constructors have run
+        config_.release(resource_);
+        config_.assign(definition_->state_count(), resource_);
+        definition_->start(config_, context());
+
+        published_.reserve(config_.word_count(), resource_);
+        published_.publish(config_);
+    }
+
+private:
+    MemoryResource* resource_;
+    MemoryResource* event_resource_;
+    Backend* backend_;
+    bool owns_backend_ = false;
+    const definition_type* definition_;
+    definition_type* owned_definition_ = nullptr;  // unless shared
+    _inner::Configuration config_;
+    _inner::PublishedConfiguration published_;
+
+    std::unique_ptr<Wakeup, _inner::Deleter> init_event_;
+    std::unique_ptr<Wakeup, _inner::Deleter> send_event_;
+    std::mutex queue_mutex_;
+    // intrusive, the queues never allocate
+    _inner::EventQueue event_queue_;
+    _inner::EventQueue high_event_queue_;
+    _inner::List<StateMachineGroup<STATE_POLICY, CONTEXT>*> groups_;
+    _inner::EventQueue deferred_;
+    _inner::EventQueue ready_;  // released deferred events
+    bool receiving_ = false;
+    bool running_ = false;  // started
+    bool initialized_ = false;
+
+    size_t budget_events_ = 0;
+    std::chrono::nanoseconds budget_time_ = std::chrono::nanoseconds::zero();
+    std::atomic<uint64_t> budget_exhausted_count_{0};
+};
+
+// Delivers broadcast events to a set of machines running on the same loop.
+// A broadcast event is created once, shared by every member and delivered
+// with a single wakeup. Members whose active configuration has no transition
+// for the event, nor defers it, are skipped without dispatching, as are
+// members not started or stopped.
+// Broadcast events are not ordered with events sent to the members directly.
+template <typename STATE_POLICY, typename CONTEXT>
+class StateMachineGroup {
+public:
+    using EVENT_ID = typename STATE_POLICY::EVENT;
+    using machine_type = StateMachine<STATE_POLICY, CONTEXT>;
+
+    template <EVENT_ID EVENT>
+    using event_class = typename machine_type::template event_class<EVENT>;
+
+#ifndef SEEDSM_NO_LIBEV
+    explicit StateMachineGroup(ev::loop_ref loop,
+                               MemoryResource* resource = new_delete_resource(),
+                               MemoryResource* event_resource = nullptr)
+        : StateMachineGroup(*_inner::create<LibevBackend>(resource, loop),
+                            resource, event_resource) {
+        owns_backend_ = true;
+    }
+#endif
+
+    // Broadcast events and their queue are allocated from `event_resource`
+    // (`resource` when null), like the events of StateMachine.
+    explicit StateMachineGroup(Backend& backend,
+                               MemoryResource* resource = new_delete_resource(),
+                               MemoryResource* event_resource = nullptr)
+        : resource_(resource)
+        , event_resource_(event_resource ? event_resource : resource)
+        , backend_(&backend)
+        , broadcast_event_(backend.create_wakeup([this] { received(); },
+                                                 resource))
+        , event_queue_(event_resource_)
+        , members_(resource) {}
+
+    ~StateMachineGroup() {
+        for (auto&& sm : members_) {
+            if (sm) sm->groups_.remove(this);
+        }
+
+        broadcast_event_.reset();
+#ifndef SEEDSM_NO_LIBEV
+        if (owns_backend_) {
+            _inner::destroy(resource_, static_cast<LibevBackend*>(backend_));
+        }
+#endif
+    }
+
+    StateMachineGroup(const StateMachineGroup&) = delete;
+    StateMachineGroup& operator=(const StateMachineGroup&) = delete;
+
+    // `add()` and `remove()` must be called on the loop thread.
+    void add(machine_type* sm) {
+        assert(sm);
+        assert(sm->backend_->loop_id() == backend_->loop_id() &&
+               "members must run on the loop of the group");
+        assert(std::find(members_.begin(), members_.end(), sm) ==
+               members_.end());
+
+        members_.push_back(sm);
+        sm->groups_.push_back(this);
     }
 
-    _inner::State* state(STATE_ID st) {
-        // TODO: return const_cast<_inner::State*>(static_cast<const
-        // StateMachine*>(this)->state(st));
-        assert(states_.count(st) == 1);
-        return states_[st];
+    void remove(machine_type* sm) {
+        auto it = std::find(members_.begin(), members_.end(), sm);
+        if (it == members_.end()) return;
+
+        sm->groups_.remove(this);
+
+        if (dispatching_) {
+            // compacted when the current broadcast is finished
+            *it = nullptr;
+            has_removed_ = true;
+        } else {
+            members_.erase(it);
+        }
     }
 
-    const _inner::State* state(STATE_ID st) const {
-        // TODO: return state_impl(st);
-        assert(states_.count(st) == 1);
-        return states_[st];
+    size_t size() const { return members_.size(); }
+
+    void start() { broadcast_event_->start(); }
+
+    void stop() { broadcast_event_->stop(); }
+
+    template <EVENT_ID E, typename... Args>
+    void broadcast(Args&&... args) {
+        auto event = event_ptr(
+            event_class<E>::create(event_resource_,
+                                   std::forward<Args>(args)...),
+            _inner::Deleter(), PolymorphicAllocator<char>(event_resource_));
+        post_event(std::move(event));
     }
 
 private:
-    ev::loop_ref loop_;
-    std::map<STATE_ID, _inner::State*> states_;
-    std::map<std::pair<_inner::State*, EVENT_ID>, _inner::Transition*>
-        transitions_;
+    using event_ptr = std::shared_ptr<const _inner::Event<EVENT_ID>>;
 
-    std::unique_ptr<ev::async> init_event_;
-    std::unique_ptr<ev::async> send_event_;
-    std::mutex queue_mutex_;
-    std::deque<_inner::EventBase*> event_queue_;
-    std::deque<_inner::EventBase*> high_event_queue_;
+    void post_event(event_ptr ev) {
+        std::unique_lock<std::mutex> lock(queue_mutex_);
+        event_queue_.push_back(std::move(ev));
+        broadcast_event_->send();
+    }
 
-    void create_state(_inner::State* parent, STATE_ID child) {
-        assert(states_.count(child) == 0);
+    event_ptr pop_event() {
+        std::unique_lock<std::mutex> lock(queue_mutex_);
+        if (event_queue_.empty()) return nullptr;
 
-        states_[child] = new _inner::State(to_string(child), parent);
+        auto ev = std::move(event_queue_.front());
+        event_queue_.pop_front();
+        return ev;
     }
 
-    _inner::State* id_to_state(STATE_ID st) {
-        assert(states_.count(st) == 1);
-        return states_[st];
+    void received() {
+        for (;;) {
+            auto ev = pop_event();
+            if (!ev) return;
+
+            dispatching_ = true;
+
+            // looked up once for the members sharing a definition
+            const typename machine_type::definition_type* definition =
+                nullptr;
+            const typename machine_type::definition_type::EventStates*
+                states = nullptr;
+
+            // machines added by callbacks don't receive the current event,
+            // stopped ones never do
+            for (size_t i = 0, n = members_.size(); i < n; ++i) {
+                auto sm = members_[i];
+                if (!sm || !sm->running_) continue;
+                sm->initialize();
+
+                if (sm->definition_ != definition) {
+                    definition = sm->definition_;
+                    states = definition->find_event_states(ev->type());
+                }
+                if (definition->is_expected(sm->config_, states)) {
+                    sm->deliver(ev);
+                }
+            }
+
+            dispatching_ = false;
+
+            if (has_removed_) {
+                members_.erase(
+                    std::remove(members_.begin(), members_.end(), nullptr),
+                    members_.end());
+                has_removed_ = false;
+            }
+        }
     }
+
+private:
+    MemoryResource* resource_;
+    MemoryResource* event_resource_;
+    Backend* backend_;
+    bool owns_backend_ = false;
+    std::unique_ptr<Wakeup, _inner::Deleter> broadcast_event_;
+    std::mutex queue_mutex_;
+    _inner::Deque<event_ptr> event_queue_;
+    _inner::Vector<machine_type*> members_;
+    bool dispatching_ = false;
+    bool has_removed_ = false;
 };
 
 }  // namespace seedsm
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <condition_variable>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "seedsm.h"
+
+namespace seedsm {
+
+namespace _inner {
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// Pins the calling thread to `cpu` while it lives, then restores the
+// previous affinity. Does nothing for a negative `cpu`.
+class CpuPin {
+public:
+    explicit CpuPin(int cpu) {
+        if (cpu < 0) return;
+#ifdef __linux__
+        int err = pthread_getaffinity_np(pthread_self(), sizeof(previous_),
+                                         &previous_);
+        if (err != 0) {
+            log("failed to get the cpu affinity: %s", strerror(err));
+            return;
+        }
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0) {
+            log("failed to pin to cpu %d: %s", cpu, strerror(err));
+            return;
+        }
+        pinned_ = true;
+#else
+        log("pinning to cpu %d is not supported", cpu);
+#endif
+    }
+
+    ~CpuPin() {
+#ifdef __linux__
+        if (pinned_) {
+            pthread_setaffinity_np(pthread_self(), sizeof(previous_),
+                                   &previous_);
+        }
+#endif
+    }
+
+    CpuPin(const CpuPin&) = delete;
+    CpuPin& operator=(const CpuPin&) = delete;
+
+private:
+#ifdef __linux__
+    cpu_set_t previous_;
+#endif
+    bool pinned_ = false;
+};
+
+}  // _inner
+
+// Low latency backend for a dedicated (ideally isolated) core. `run()`
+// spins on the pending wakeups, then backs off to `std::this_thread::yield()`
+// and finally parks on a condition variable. Producers only make a syscall
+// to wake the dispatcher when it is parked. A started ShmReceiver, which
+// has no doorbell here, keeps it spinning.
+//
+// Machines must be started before `run()` or from its callbacks, and must
+// not be destroyed while it runs.
+class BusyPollBackend : public ManualBackend {
+public:
+    explicit BusyPollBackend(size_t spin_count = 100000,
+                             size_t yield_count = 1000,
+                             MemoryResource* resource = new_delete_resource())
+        : ManualBackend(resource)
+        , spin_count_(spin_count)
+        , yield_count_(yield_count) {}
+
+    // Dispatches on the calling thread until every wakeup is stopped or
+    // `quit()` is called. The thread is pinned to `cpu` unless it is
+    // negative, and gets its previous affinity back when `run()` returns.
+    void run(int cpu = -1) {
+        _inner::CpuPin pin(cpu);
+
+        size_t idle = 0;
+        while (active() > 0 && !quit_.load(std::memory_order_relaxed)) {
+            if (poll() > 0) {
+                idle = 0;
+                continue;
+            }
+
+            ++idle;
+            if (idle <= spin_count_) {
+                _inner::cpu_relax();
+            } else if (idle <= spin_count_ + yield_count_) {
+                std::this_thread::yield();
+            } else {
+                park();
+                idle = 0;
+            }
+        }
+        quit_.store(false);
+    }
+
+    // May be called from any thread.
+    void quit() {
+        quit_.store(true);
+        std::unique_lock<std::mutex> lock(park_mutex_);
+        park_cv_.notify_one();
+    }
+
+    bool spins() const override { return true; }
+
+    // number of times the dispatcher parked
+    uint64_t park_count() const { return park_count_.load(); }
+
+    // number of times a producer had to wake the parked dispatcher
+    uint64_t wake_count() const { return wake_count_.load(); }
+
+protected:
+    // called with the pending list locked, right after it stops being empty
+    void notify() override {
+        if (!parked_.load()) return;
+
+        std::unique_lock<std::mutex> lock(park_mutex_);
+        parked_.store(false);
+        wake_count_++;
+        park_cv_.notify_one();
+    }
+
+private:
+    void park() {
+        parked_.store(true);
+        // a producer which didn't see `parked_` scheduled before this check
+        if (has_pending() || quit_.load()) {
+            parked_.store(false);
+            return;
+        }
+
+        ++park_count_;
+        std::unique_lock<std::mutex> lock(park_mutex_);
+        park_cv_.wait(lock, [this] { return !parked_.load() || quit_.load(); });
+        parked_.store(false);
+    }
+
+    const size_t spin_count_;
+    const size_t yield_count_;
+    std::mutex park_mutex_;
+    std::condition_variable park_cv_;
+    std::atomic<bool> parked_{false};
+    std::atomic<bool> quit_{false};
+    std::atomic<uint64_t> wake_count_{0};
+    std::atomic<uint64_t> park_count_{0};
+};
+
+}  // namespace seedsm
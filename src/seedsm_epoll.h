@@ -0,0 +1,164 @@
+#pragma once
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+#include "seedsm.h"
+
+namespace seedsm {
+
+// libev-free backend for Linux. Sent wakeups are collected in one pending
+// list and an eventfd is written only when that list stops being empty,
+// so a burst of sends costs a single write() and a single epoll_wait().
+// `fd()` is an epoll descriptor which can be registered in a host reactor:
+// call `run_once(0)` when it becomes readable.
+// Fd watchers are level-triggered epoll registrations on the same descriptor.
+class EpollBackend : public ManualBackend {
+public:
+    explicit EpollBackend(MemoryResource* resource = new_delete_resource())
+        : ManualBackend(resource) {
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd_ < 0) abort("epoll_create1 failed: %s", strerror(errno));
+
+        event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (event_fd_ < 0) abort("eventfd failed: %s", strerror(errno));
+
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.ptr = this;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &ev) < 0) {
+            abort("epoll_ctl failed: %s", strerror(errno));
+        }
+    }
+
+    ~EpollBackend() {
+        close(event_fd_);
+        close(epoll_fd_);
+    }
+
+    FdWatcher* create_fd_watcher(int fd, std::function<void()> fn,
+                                 MemoryResource* resource) override {
+        return _inner::create<EpollWatcher>(resource, this, fd, std::move(fn),
+                                            resource);
+    }
+
+    int fd() const { return epoll_fd_; }
+
+    // Waits up to `timeout_ms` (-1: forever) for wakeups and runs their
+    // callbacks. Returns how many ran.
+    size_t run_once(int timeout_ms = -1) {
+        ++syscall_count_;
+        int n = epoll_wait(epoll_fd_, ready_, max_ready, timeout_ms);
+        if (n < 0 && errno != EINTR) {
+            abort("epoll_wait failed: %s", strerror(errno));
+        }
+        ready_count_ = n > 0 ? n : 0;
+
+        size_t count = 0;
+        for (int i = 0; i < ready_count_; ++i) {
+            auto ptr = ready_[i].data.ptr;
+            if (ptr == this) {
+                uint64_t value;
+                ++syscall_count_;
+                // must be drained before poll() for no notify to be lost
+                if (read(event_fd_, &value, sizeof(value)) < 0 &&
+                    errno != EAGAIN) {
+                    abort("eventfd read failed: %s", strerror(errno));
+                }
+            } else if (ptr) {  // null when stopped by a previous callback
+                static_cast<EpollWatcher*>(ptr)->fn_();
+                ++count;
+            }
+        }
+        ready_count_ = 0;
+
+        return count + poll();
+    }
+
+    // Runs until every wakeup and watcher is stopped, like
+    // `ev::loop_ref::run(0)`.
+    void run() {
+        while (active() > 0 || watching_ > 0) {
+            run_once(-1);
+        }
+    }
+
+    // number of syscalls made by the backend, including notifications
+    uint64_t syscall_count() const { return syscall_count_ + notify_count(); }
+
+protected:
+    void notify() override {
+        uint64_t one = 1;
+        if (write(event_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            abort("eventfd write failed: %s", strerror(errno));
+        }
+    }
+
+private:
+    class EpollWatcher : public FdWatcher {
+    public:
+        EpollWatcher(EpollBackend* backend, int fd, std::function<void()> fn,
+                     MemoryResource* resource)
+            : backend_(backend)
+            , fd_(fd)
+            , fn_(std::move(fn))
+            , resource_(resource) {}
+
+        void start() override {
+            if (is_active_) return;
+
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.ptr = this;
+            if (epoll_ctl(backend_->epoll_fd_, EPOLL_CTL_ADD, fd_, &ev) < 0) {
+                abort("epoll_ctl failed: %s", strerror(errno));
+            }
+            is_active_ = true;
+            backend_->watching_++;
+        }
+
+        void stop() override {
+            if (!is_active_) return;
+
+            epoll_ctl(backend_->epoll_fd_, EPOLL_CTL_DEL, fd_, nullptr);
+            backend_->forget(this);
+            is_active_ = false;
+            backend_->watching_--;
+        }
+
+        void destroy() override {
+            stop();
+            _inner::destroy(resource_, this);
+        }
+
+    private:
+        friend class EpollBackend;
+
+        EpollBackend* backend_;
+        int fd_;
+        std::function<void()> fn_;
+        MemoryResource* resource_;
+        bool is_active_ = false;
+    };
+
+    // drops the events of `w` not yet handled by `run_once()`
+    void forget(EpollWatcher* w) {
+        for (int i = 0; i < ready_count_; ++i) {
+            if (ready_[i].data.ptr == w) ready_[i].data.ptr = nullptr;
+        }
+    }
+
+    static const int max_ready = 16;
+
+    int epoll_fd_ = -1;
+    int event_fd_ = -1;
+    uint64_t syscall_count_ = 0;
+    struct epoll_event ready_[max_ready];
+    int ready_count_ = 0;
+    size_t watching_ = 0;
+};
+
+}  // namespace seedsm
@@ -0,0 +1,575 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+#include "seedsm.h"
+
+#ifndef SEEDSM_SHM_SOCKET_DIR
+#define SEEDSM_SHM_SOCKET_DIR "/tmp"
+#endif
+
+namespace seedsm {
+
+namespace _inner {
+
+// Layout of a shared segment: the header, then `capacity` slots of
+// `slot_size` bytes. The ring is a bounded multi-producer queue where each
+// slot carries the sequence number of the position it is ready for, so
+// producers reserve slots with a single CAS and never wait for each other.
+//
+// Any process mapping the segment can write the header: the geometry is
+// only read by `open()`, and the consumer position isn't shared.
+struct ShmHeader {
+    static const uint32_t magic_value = 0x73656564;  // "seed"
+
+    // written last by the receiver: the rest is valid once it's seen.
+    // Cleared when the receiver is gone.
+    std::atomic<uint32_t> magic;
+    uint32_t slot_size;
+    uint64_t capacity;  // power of two
+
+    alignas(64) std::atomic<uint64_t> enqueue_pos;
+    // set by the consumer before it waits for the doorbell
+    alignas(64) std::atomic<uint32_t> sleeping;
+};
+
+struct ShmSlot {
+    std::atomic<uint64_t> sequence;
+    int32_t event;
+    uint32_t size;
+    // followed by the payload
+
+    unsigned char* payload() {
+        return reinterpret_cast<unsigned char*>(this + 1);
+    }
+};
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "shared memory atomics must be lock-free");
+
+class ShmSegment {
+public:
+    ShmSegment() {}
+
+    ShmSegment(const ShmSegment&) = delete;
+    ShmSegment& operator=(const ShmSegment&) = delete;
+
+    ~ShmSegment() { close(); }
+
+    void close() {
+        if (header_) munmap(header_, size_);
+        header_ = nullptr;
+        size_ = 0;
+        capacity_ = 0;
+        slot_size_ = 0;
+        dequeue_pos_ = 0;
+    }
+
+    // creates the segment, replacing a stale one of the same name
+    void create(const std::string& name, size_t capacity, size_t max_payload) {
+        size_t n = 1;
+        while (n < capacity) n <<= 1;
+
+        size_t slot_size = (sizeof(ShmSlot) + max_payload + 63) / 64 * 64;
+        size_t size = sizeof(ShmHeader) + n * slot_size;
+
+        shm_unlink(name.c_str());
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0) abort("shm_open failed: %s", strerror(errno));
+        if (ftruncate(fd, size) < 0) {
+            abort("ftruncate failed: %s", strerror(errno));
+        }
+        if (!map(fd, size)) abort("mmap failed: %s", strerror(errno));
+        ::close(fd);
+
+        capacity_ = n;
+        slot_size_ = slot_size;
+
+        new (&header_->magic) std::atomic<uint32_t>(0);
+        header_->slot_size = slot_size;
+        header_->capacity = n;
+        new (&header_->enqueue_pos) std::atomic<uint64_t>(0);
+        new (&header_->sleeping) std::atomic<uint32_t>(0);
+
+        for (size_t i = 0; i < n; ++i) {
+            new (&slot(i)->sequence) std::atomic<uint64_t>(i);
+        }
+
+        header_->magic.store(ShmHeader::magic_value, std::memory_order_release);
+    }
+
+    // Maps the segment created by another process. Returns false when it
+    // doesn't exist or isn't initialized yet.
+    bool open(const std::string& name) {
+        close();
+
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        if (fd < 0) return false;
+
+        struct stat st;
+        bool mapped = fstat(fd, &st) == 0 &&
+                      static_cast<size_t>(st.st_size) >= sizeof(ShmHeader) &&
+                      map(fd, st.st_size);
+        ::close(fd);
+        if (!mapped) return false;
+
+        if (header_->magic.load(std::memory_order_acquire) !=
+            ShmHeader::magic_value) {
+            close();
+            return false;
+        }
+
+        // read once: the header may change under our feet
+        auto capacity = *static_cast<volatile uint64_t*>(&header_->capacity);
+        auto slot_size = *static_cast<volatile uint32_t*>(&header_->slot_size);
+        if (capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+            slot_size < sizeof(ShmSlot) || slot_size % alignof(ShmSlot) != 0 ||
+            capacity > (size_ - sizeof(ShmHeader)) / slot_size ||
+            size_ != sizeof(ShmHeader) + capacity * slot_size) {
+            close();
+            return false;
+        }
+
+        capacity_ = capacity;
+        slot_size_ = slot_size;
+        return true;
+    }
+
+    bool is_open() const { return header_ != nullptr; }
+
+    // tells the producers that the consumer is gone
+    void mark_closed() {
+        header_->magic.store(0, std::memory_order_release);
+    }
+
+    bool is_closed() const {
+        return header_->magic.load(std::memory_order_acquire) !=
+               ShmHeader::magic_value;
+    }
+
+    ShmHeader* header() const { return header_; }
+
+    size_t capacity() const { return capacity_; }
+
+    size_t max_payload() const { return slot_size_ - sizeof(ShmSlot); }
+
+    ShmSlot* slot(uint64_t pos) const {
+        auto base = reinterpret_cast<unsigned char*>(header_ + 1);
+        return reinterpret_cast<ShmSlot*>(base +
+                                          (pos & (capacity_ - 1)) * slot_size_);
+    }
+
+    // Copies an event into the ring. Returns false when the ring is full.
+    bool push(int32_t event, const void* payload, uint32_t size) {
+        auto pos = header_->enqueue_pos.load(std::memory_order_relaxed);
+        ShmSlot* s;
+        for (;;) {
+            s = slot(pos);
+            auto seq = s->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<int64_t>(seq - pos);
+            if (diff == 0) {
+                if (header_->enqueue_pos.compare_exchange_weak(
+                        pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = header_->enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        s->event = event;
+        s->size = size;
+        if (size) memcpy(s->payload(), payload, size);
+        s->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Returns the oldest published slot, or nullptr. Single consumer only.
+    ShmSlot* front() const {
+        auto s = slot(dequeue_pos_);
+        if (s->sequence.load(std::memory_order_acquire) != dequeue_pos_ + 1) {
+            return nullptr;
+        }
+        return s;
+    }
+
+    // hands the slot returned by `front()` back to the producers
+    void pop() {
+        slot(dequeue_pos_)->sequence.store(dequeue_pos_ + capacity_,
+                                           std::memory_order_release);
+        ++dequeue_pos_;
+    }
+
+private:
+    bool map(int fd, size_t size) {
+        void* p =
+            mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) return false;
+
+        header_ = static_cast<ShmHeader*>(p);
+        size_ = size;
+        return true;
+    }
+
+    ShmHeader* header_ = nullptr;
+    size_t size_ = 0;
+    // private copies of the geometry, checked by `open()`
+    size_t capacity_ = 0;
+    size_t slot_size_ = 0;
+    uint64_t dequeue_pos_ = 0;  // of the consumer
+};
+
+// Address of the doorbell of the segment `name`, a unix datagram socket.
+// Returns false when the path doesn't fit.
+inline bool shm_doorbell_address(const std::string& name, sockaddr_un* addr) {
+    auto path =
+        std::string(SEEDSM_SHM_SOCKET_DIR) + "/seedsm-" + name + ".sock";
+    if (path.size() >= sizeof(addr->sun_path)) return false;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path.c_str(), path.size());
+    return true;
+}
+
+}  // _inner
+
+// Owning side of a shared-memory event transport. Creates the segment
+// `name` (and its doorbell socket in SEEDSM_SHM_SOCKET_DIR) and dispatches
+// the events enqueued by ShmSender, from any process, on the machine's loop.
+//
+// Producers only write the doorbell when the receiver has found the ring
+// empty, so a busy receiver costs no syscall on either side. Backends which
+// can't watch descriptors are never rung: a spinning one (BusyPollBackend)
+// polls the ring on every spin, and doesn't park while the receiver is
+// started; with the others (ManualBackend) the host calls `poll()` itself.
+//
+// Events are dispatched as soon as they are drained, without going through
+// the machine's own queue, and are not ordered with events sent to it.
+// They are dropped while the machine is stopped.
+// Must be started after the machine, and used on its loop thread.
+template <typename STATE_POLICY, typename CONTEXT>
+class ShmReceiver {
+public:
+    using EVENT_ID = typename STATE_POLICY::EVENT;
+    using machine_type = StateMachine<STATE_POLICY, CONTEXT>;
+
+    template <EVENT_ID EVENT>
+    using event_class = typename machine_type::template event_class<EVENT>;
+
+    // `max_payload` is the largest event data which can be sent, in bytes.
+    ShmReceiver(machine_type& sm, const std::string& name,
+                size_t capacity = 1024, size_t max_payload = 64)
+        : sm_(sm), name_(name), decoders_(sm.resource()) {
+        if (!_inner::shm_doorbell_address(name, &doorbell_addr_)) {
+            abort("shm: name too long: %s", name.c_str());
+        }
+
+        // the doorbell first: senders expect it once the segment is there
+        doorbell_fd_ =
+            socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (doorbell_fd_ < 0) abort("socket failed: %s", strerror(errno));
+        unlink(doorbell_addr_.sun_path);
+        if (bind(doorbell_fd_, reinterpret_cast<sockaddr*>(&doorbell_addr_),
+                 sizeof(doorbell_addr_)) < 0) {
+            abort("bind failed: %s", strerror(errno));
+        }
+
+        segment_.create("/" + name, capacity, max_payload);
+
+        auto resource = sm.resource();
+        watcher_.reset(sm.backend_->create_fd_watcher(
+            doorbell_fd_, [this] { rung(); }, resource));
+        resume_.reset(
+            sm.backend_->create_wakeup([this] { poll(); }, resource));
+    }
+
+    ~ShmReceiver() {
+        segment_.mark_closed();
+        watcher_.reset();
+        resume_.reset();
+
+        close(doorbell_fd_);
+        unlink(doorbell_addr_.sun_path);
+        shm_unlink(("/" + name_).c_str());
+    }
+
+    ShmReceiver(const ShmReceiver&) = delete;
+    ShmReceiver& operator=(const ShmReceiver&) = delete;
+
+    // Events which were not accepted, or whose size doesn't match their
+    // type, are dropped.
+    template <EVENT_ID E>
+    void accept() {
+        using data_type = typename event_class<E>::data_type;
+        static_assert(std::is_void<data_type>::value ||
+                          std::is_trivially_copyable<data_type>::value,
+                      "shared memory events must be trivially copyable");
+
+        auto size = payload_size<E>(std::is_void<data_type>());
+        if (size > segment_.max_payload()) {
+            abort("shm: event %d is larger than the slots",
+                  static_cast<int>(E));
+        }
+        decoders_[static_cast<int32_t>(E)] = Decoder{&decode<E>, size};
+    }
+
+    void start() {
+        if (watcher_) watcher_->start();
+        resume_->start();
+        resume_->send();
+    }
+
+    void stop() {
+        segment_.header()->sleeping.store(0, std::memory_order_relaxed);
+        resume_->stop();
+        if (watcher_) watcher_->stop();
+    }
+
+    // Dispatches the enqueued events, at most the ring capacity per call so
+    // that producers can't starve the loop. Returns how many were drained.
+    size_t poll() {
+        auto header = segment_.header();
+        size_t count = 0;
+
+        for (;;) {
+            auto slot = segment_.front();
+            if (!slot) {
+                if (!watcher_) {
+                    if (sm_.backend_->spins()) resume_->send();
+                    return count;
+                }
+
+                // the ring must be checked again once the flag is visible,
+                // or an event pushed in between would wait for the next one
+                header->sleeping.store(1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (!segment_.front()) return count;
+
+                header->sleeping.store(0, std::memory_order_relaxed);
+                continue;
+            }
+
+            if (count == segment_.capacity()) {
+                resume_->send();
+                return count;
+            }
+
+            auto ev = decode_slot(slot);
+            segment_.pop();
+            ++count;
+
+            if (ev && sm_.running_) {
+                sm_.initialize();
+                sm_.deliver(std::move(ev));
+            }
+        }
+    }
+
+private:
+    using event_ptr =
+        std::unique_ptr<_inner::Event<EVENT_ID>, _inner::Deleter>;
+    struct Decoder {
+        _inner::Event<EVENT_ID>* (*fn)(MemoryResource*, const unsigned char*);
+        uint32_t size;  // of the payload
+    };
+
+    template <EVENT_ID E>
+    static uint32_t payload_size(std::true_type) {
+        return 0;
+    }
+
+    template <EVENT_ID E>
+    static uint32_t payload_size(std::false_type) {
+        return sizeof(typename event_class<E>::data_type);
+    }
+
+    template <EVENT_ID E>
+    static _inner::Event<EVENT_ID>* decode(MemoryResource* resource,
+                                           const unsigned char* payload) {
+        return create<E>(resource, payload,
+                         std::is_void<typename event_class<E>::data_type>());
+    }
+
+    template <EVENT_ID E>
+    static _inner::Event<EVENT_ID>* create(MemoryResource* resource,
+                                           const unsigned char*,
+                                           std::true_type) {
+        return event_class<E>::create(resource);
+    }
+
+    template <EVENT_ID E>
+    static _inner::Event<EVENT_ID>* create(MemoryResource* resource,
+                                           const unsigned char* payload,
+                                           std::false_type) {
+        typename event_class<E>::data_type data;
+        memcpy(&data, payload, sizeof(data));
+        return event_class<E>::create(resource, data);
+    }
+
+    event_ptr decode_slot(_inner::ShmSlot* slot) {
+        auto it = decoders_.find(slot->event);
+        if (it == decoders_.end()) {
+            log("shm: event %d is not accepted", slot->event);
+            return nullptr;
+        }
+
+        // written by another process: never trusted to fit the slot
+        if (slot->size != it->second.size) {
+            log("shm: event %d has %u bytes instead of %u", slot->event,
+                slot->size, it->second.size);
+            return nullptr;
+        }
+
+        return event_ptr(
+            it->second.fn(sm_.event_resource(), slot->payload()));
+    }
+
+    void rung() {
+        char buf[64];
+        while (recv(doorbell_fd_, buf, sizeof(buf), 0) > 0) {
+        }
+        poll();
+    }
+
+    machine_type& sm_;
+    std::string name_;
+    sockaddr_un doorbell_addr_;
+    _inner::ShmSegment segment_;
+    int doorbell_fd_ = -1;
+    _inner::Map<int32_t, Decoder> decoders_;
+    std::unique_ptr<FdWatcher, _inner::Deleter> watcher_;
+    std::unique_ptr<Wakeup, _inner::Deleter> resume_;
+};
+
+// Producer side of a shared-memory event transport, from any process.
+// `send()` copies the event into the ring in place and makes a single
+// syscall only to wake a sleeping receiver. It may be called by several
+// threads at once, but not along with `open()` or `close()`.
+//
+// The segment can only be opened once the receiver has created it. Senders
+// started before the receiver, or losing it, retry `open()`. Events sent
+// while the receiver goes away may be lost.
+template <typename STATE_POLICY>
+class ShmSender {
+public:
+    using EVENT_ID = typename STATE_POLICY::EVENT;
+
+    template <EVENT_ID EVENT>
+    using event_class = typename _EventCreator<
+        decltype(EVENT), static_cast<int>(EVENT)>::EVENT_CLASS;
+
+    ShmSender() {}
+
+    // check `is_open()`
+    explicit ShmSender(const std::string& name) { open(name); }
+
+    ~ShmSender() { close(); }
+
+    ShmSender(const ShmSender&) = delete;
+    ShmSender& operator=(const ShmSender&) = delete;
+
+    // Maps the segment `name`. Returns false when there is no receiver for
+    // it (yet).
+    bool open(const std::string& name) {
+        close();
+
+        sockaddr_un addr;
+        if (!_inner::shm_doorbell_address(name, &addr)) return false;
+        if (!segment_.open("/" + name)) return false;
+
+        doorbell_fd_ = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (doorbell_fd_ < 0 ||
+            connect(doorbell_fd_, reinterpret_cast<sockaddr*>(&addr),
+                    sizeof(addr)) < 0) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    // false once the receiver is found gone
+    bool is_open() const {
+        return segment_.is_open() && !lost_.load(std::memory_order_relaxed);
+    }
+
+    void close() {
+        if (doorbell_fd_ >= 0) ::close(doorbell_fd_);
+        doorbell_fd_ = -1;
+        segment_.close();
+        lost_.store(false, std::memory_order_relaxed);
+    }
+
+    // Returns false when the ring is full, or the sender is not open.
+    template <EVENT_ID E>
+    bool send() {
+        static_assert(std::is_void<typename event_class<E>::data_type>::value,
+                      "event has data");
+        return push(static_cast<int32_t>(E), nullptr, 0);
+    }
+
+    template <EVENT_ID E>
+    bool send(const typename event_class<E>::data_type& data) {
+        using data_type = typename event_class<E>::data_type;
+        static_assert(std::is_trivially_copyable<data_type>::value,
+                      "shared memory events must be trivially copyable");
+
+        if (!is_open()) return false;
+        if (sizeof(data_type) > segment_.max_payload()) {
+            abort("shm: event %d is larger than the slots",
+                  static_cast<int>(E));
+        }
+        return push(static_cast<int32_t>(E), &data, sizeof(data_type));
+    }
+
+    // number of rings of the doorbell, i.e. wakeups of a sleeping receiver
+    uint64_t doorbell_count() const {
+        return doorbell_count_.load(std::memory_order_relaxed);
+    }
+
+private:
+    bool push(int32_t event, const void* payload, uint32_t size) {
+        if (!is_open()) return false;
+        if (segment_.is_closed()) {
+            // left mapped: other threads may be pushing
+            log("shm: receiver is gone");
+            lost_.store(true, std::memory_order_relaxed);
+            return false;
+        }
+        if (!segment_.push(event, payload, size)) return false;
+
+        // pairs with the fence of ShmReceiver::poll()
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto& sleeping = segment_.header()->sleeping;
+        if (sleeping.load(std::memory_order_relaxed) &&
+            sleeping.exchange(0)) {
+            // full when the receiver was already rung
+            char one = 1;
+            auto n = ::send(doorbell_fd_, &one, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0 && errno != EAGAIN) {
+                // left mapped: other threads may be pushing
+                log("shm: receiver is gone: %s", strerror(errno));
+                lost_.store(true, std::memory_order_relaxed);
+                return false;
+            }
+            doorbell_count_.fetch_add(1, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    _inner::ShmSegment segment_;
+    int doorbell_fd_ = -1;
+    std::atomic<bool> lost_{false};
+    std::atomic<uint64_t> doorbell_count_{0};
+};
+
+}  // namespace seedsm
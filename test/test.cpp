@@ -1,13 +1,51 @@
 
 #include "seedsm.h"
+#include "seedsm_epoll.h"
+#include "seedsm_busypoll.h"
+#include "seedsm_shm.h"
 #include "gtest/gtest.h"
 
 #include <ev++.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
+#include <atomic>
+#include <limits>
 #include <string>
+#include <thread>
 
 #include "util.h"
 
+namespace {
+std::atomic<size_t> new_count{0};
+}
+
+// every form is replaced, for none to mix with the allocator of the runtime
+// (the sized ones are called by libraries built as C++14)
+void* operator new(size_t size) {
+    ++new_count;
+    if (void* p = malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) { return operator new(size); }
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    ++new_count;
+    return malloc(size ? size : 1);
+}
+
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept {
+    return operator new(size, tag);
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { free(p); }
+
 struct Policy1 {
     enum STATE { A, B, C };
     enum EVENT { TO_A, TO_B, TO_C };
@@ -177,3 +215,1266 @@ TEST_F(Test, TestParallel) {
     EXPECT_EQ(0, sm.enter_cnt[ST::B2]);
 }
 }
+
+struct PolicyGroup {
+    enum STATE { IDLE, RUN, DONE };
+    enum EVENT { START, SHUTDOWN };
+};
+
+DEFINE_EVENT(PolicyGroup::START);
+DEFINE_EVENT_WITH_DATA(PolicyGroup::SHUTDOWN, std::string);
+
+namespace {
+
+struct SMGroup : public seedsm::StateMachine<PolicyGroup> {
+    using ST = PolicyGroup::STATE;
+    using EV = PolicyGroup::EVENT;
+
+    SMGroup(ev::loop_ref loop)
+        : StateMachine("Root", loop) {
+        create_states({ST::IDLE, ST::RUN, ST::DONE});
+        add_transition<EV::START>(ST::IDLE, ST::RUN);
+        add_transition<EV::SHUTDOWN>(ST::RUN, ST::DONE);
+
+        on_transition<EV::SHUTDOWN>(
+            ST::RUN, [this](const std::string& msg) { shutdown_msg = msg; });
+    }
+
+    std::string shutdown_msg = "";
+};
+
+TEST_F(Test, TestGroupBroadcast) {
+    using ST = PolicyGroup::STATE;
+    using EV = PolicyGroup::EVENT;
+
+    ev::dynamic_loop loop;
+    seedsm::StateMachineGroup<PolicyGroup> group(loop);
+    SMGroup sm1(loop), sm2(loop), sm3(loop);
+
+    int run_cnt = 0;
+    int done_cnt = 0;
+    for (auto sm : {&sm1, &sm2, &sm3}) {
+        group.add(sm);
+        sm->on_state_entered(ST::RUN, [&] {
+            if (++run_cnt == 2) group.broadcast<EV::SHUTDOWN>("bye");
+        });
+        sm->on_state_entered(ST::DONE, [&] {
+            if (++done_cnt == 2) {
+                group.stop();
+                for (auto sm : {&sm1, &sm2, &sm3}) sm->stop();
+            }
+        });
+        sm->start();
+    }
+    group.start();
+
+    sm1.send<EV::START>();
+    sm2.send<EV::START>();
+
+    loop.run(0);
+
+    EXPECT_EQ(2, done_cnt);
+    EXPECT_EQ("bye", sm1.shutdown_msg);
+    EXPECT_EQ("bye", sm2.shutdown_msg);
+    EXPECT_EQ("", sm3.shutdown_msg);
+}
+
+TEST_F(Test, TestGroupMemberDestroyed) {
+    ev::dynamic_loop loop;
+    seedsm::StateMachineGroup<PolicyGroup> group(loop);
+
+    {
+        SMGroup sm(loop);
+        group.add(&sm);
+        EXPECT_EQ(1u, group.size());
+    }
+
+    EXPECT_EQ(0u, group.size());
+}
+}
+
+struct PolicyAlloc {
+    enum STATE { A, B };
+    enum EVENT { TOGGLE, FIN };
+};
+
+DEFINE_EVENT(PolicyAlloc::TOGGLE);
+DEFINE_EVENT_WITH_DATA(PolicyAlloc::FIN, int);
+
+struct PolicyWide {
+    enum STATE { FIRST = 0, LAST = 299 };
+    enum EVENT { NEXT };
+};
+
+DEFINE_EVENT(PolicyWide::NEXT);
+
+namespace {
+
+struct CountingResource : public seedsm::MemoryResource {
+    size_t allocations = 0;
+    size_t deallocations = 0;
+
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        ++allocations;
+        return malloc(bytes);
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+        ++deallocations;
+        free(p);
+    }
+};
+
+struct SMAlloc : public seedsm::StateMachine<PolicyAlloc> {
+    using ST = PolicyAlloc::STATE;
+    using EV = PolicyAlloc::EVENT;
+
+    SMAlloc(ev::loop_ref loop, seedsm::MemoryResource* resource,
+            CountingResource* counting = nullptr,
+            seedsm::MemoryResource* event_resource = nullptr)
+        : StateMachine("Root", loop, resource, event_resource)
+        , counting(counting) {
+        create_states({ST::A, ST::B});
+        add_transition<EV::TOGGLE>(ST::A, ST::B);
+        add_transition<EV::TOGGLE>(ST::B, ST::A);
+        add_transition<EV::FIN>(ST::A);
+        add_transition<EV::FIN>(ST::B);
+
+        on_transition<EV::TOGGLE>(ST::A, [this] {
+            if (++toggle_cnt == 64) mark();
+        });
+        on_transition<EV::FIN>(ST::A, [this](int) { finish(); });
+        on_transition<EV::FIN>(ST::B, [this](int) { finish(); });
+    }
+
+    void mark() {
+        warm_new_count = new_count;
+        if (counting) warm_allocations = counting->allocations;
+    }
+
+    void finish() {
+        dispatch_new = new_count - warm_new_count;
+        if (counting) {
+            dispatch_allocations = counting->allocations - warm_allocations;
+        }
+        stop();
+    }
+
+    CountingResource* counting;
+    int toggle_cnt = 0;
+    size_t warm_new_count = 0;
+    size_t warm_allocations = 0;
+    size_t dispatch_new = 0;
+    size_t dispatch_allocations = 0;
+};
+
+
+// ring of 300 states, larger than the configurations copied on the stack
+struct SMWide : public seedsm::StateMachine<PolicyWide> {
+    using ST = PolicyWide::STATE;
+    using EV = PolicyWide::EVENT;
+
+    SMWide(seedsm::Backend& backend,
+           seedsm::MemoryResource* resource = seedsm::new_delete_resource())
+        : StateMachine("Root", backend, resource) {
+        for (int i = ST::FIRST; i <= ST::LAST; ++i) {
+            create_states({static_cast<ST>(i)});
+        }
+        for (int i = ST::FIRST; i <= ST::LAST; ++i) {
+            add_transition<EV::NEXT>(static_cast<ST>(i),
+                                     static_cast<ST>((i + 1) % 300));
+        }
+    }
+};
+
+TEST_F(Test, TestDispatchAllocatesNothing) {
+    using EV = PolicyAlloc::EVENT;
+
+    ev::dynamic_loop loop;
+    CountingResource resource;
+
+    {
+        SMAlloc sm(loop, &resource, &resource);
+        sm.start();
+
+        size_t before = new_count;
+        for (int i = 0; i < 1000; i++) {
+            sm.send<EV::TOGGLE>();
+        }
+        sm.send<EV::FIN>(0);
+        EXPECT_EQ(0u, new_count - before);
+
+        loop.run(0);
+
+        EXPECT_EQ(0u, sm.dispatch_new);
+        EXPECT_EQ(0u, sm.dispatch_allocations);
+    }
+
+    EXPECT_EQ(resource.allocations, resource.deallocations);
+
+    {
+        seedsm::ManualBackend backend;
+        SMWide sm(backend, &resource);
+        sm.start();
+        backend.poll();
+
+        for (int i = 0; i < 1000; i++) {
+            sm.send<PolicyWide::NEXT>();
+        }
+
+        size_t before = new_count;
+        size_t allocations = resource.allocations;
+        backend.poll();
+        EXPECT_EQ(0u, new_count - before);
+        EXPECT_EQ(0u, resource.allocations - allocations);
+        EXPECT_TRUE(sm.is_in(static_cast<PolicyWide::STATE>(1000 % 300)));
+    }
+
+    EXPECT_EQ(resource.allocations, resource.deallocations);
+}
+
+TEST_F(Test, TestMonotonicResource) {
+    using EV = PolicyAlloc::EVENT;
+
+    ev::dynamic_loop loop;
+    CountingResource arena_upstream;
+    seedsm::MonotonicBufferResource arena(4096, &arena_upstream);
+    CountingResource pool_upstream;
+    seedsm::SynchronizedPoolResource pool(&pool_upstream);
+
+    SMAlloc sm(loop, &arena, nullptr, &pool);
+    sm.start();
+
+    size_t arena_chunks = 0;
+    size_t pool_chunks = 0;
+    for (int batch = 0; batch < 200; batch++) {
+        std::thread producer([&] {
+            for (int i = 0; i < 500; i++) {
+                sm.send<EV::TOGGLE>();
+            }
+        });
+        producer.join();
+        loop.run(ev::NOWAIT);
+
+        if (batch == 0) {
+            arena_chunks = arena_upstream.allocations;
+            pool_chunks = pool_upstream.allocations;
+        }
+    }
+
+    // events are recycled by the pool, nothing more comes from the arena
+    EXPECT_EQ(arena_chunks, arena_upstream.allocations);
+    EXPECT_EQ(pool_chunks, pool_upstream.allocations);
+
+    sm.send<EV::FIN>(0);
+    loop.run(0);
+
+    EXPECT_EQ(50000, sm.toggle_cnt);
+}
+}
+
+namespace {
+
+struct SMBackend : public seedsm::StateMachine<PolicyGroup> {
+    using ST = PolicyGroup::STATE;
+    using EV = PolicyGroup::EVENT;
+
+    SMBackend(seedsm::Backend& backend)
+        : StateMachine("Root", backend) {
+        create_states({ST::IDLE, ST::RUN, ST::DONE});
+        add_transition<EV::START>(ST::IDLE, ST::RUN);
+        add_transition<EV::SHUTDOWN>(ST::RUN, ST::DONE);
+
+        on_transition<EV::SHUTDOWN>(
+            ST::RUN, [this](const std::string& msg) { shutdown_msg = msg; });
+        on_state_entered(ST::DONE, [this] { stop(); });
+    }
+
+    std::string shutdown_msg = "";
+};
+
+TEST_F(Test, TestManualBackend) {
+    using EV = PolicyGroup::EVENT;
+
+    seedsm::ManualBackend backend;
+    SMBackend sm(backend);
+
+    EXPECT_EQ(0u, backend.poll());
+
+    sm.start();
+    sm.send<EV::START>();
+    sm.send<EV::SHUTDOWN>("manual");
+    EXPECT_EQ(1u, backend.notify_count());
+
+    while (backend.active() > 0) {
+        backend.poll();
+    }
+
+    EXPECT_EQ("manual", sm.shutdown_msg);
+    EXPECT_FALSE(backend.has_pending());
+}
+
+TEST_F(Test, TestGroupStoppedMember) {
+    using ST = PolicyGroup::STATE;
+    using EV = PolicyGroup::EVENT;
+
+    seedsm::ManualBackend backend;
+    seedsm::StateMachineGroup<PolicyGroup> group(backend);
+    SMBackend running(backend), stopped(backend), idle(backend);
+    for (auto sm : {&running, &stopped, &idle}) {
+        group.add(sm);
+    }
+    group.start();
+
+    // `idle` is never started
+    for (auto sm : {&running, &stopped}) {
+        sm->start();
+        sm->send<EV::START>();
+    }
+    backend.poll();
+    stopped.stop();
+
+    group.broadcast<EV::SHUTDOWN>("bye");
+    backend.poll();
+
+    EXPECT_TRUE(running.is_in(ST::DONE));
+    EXPECT_EQ("bye", running.shutdown_msg);
+    EXPECT_TRUE(stopped.is_in(ST::RUN));
+    EXPECT_EQ("", stopped.shutdown_msg);
+    EXPECT_EQ("", idle.shutdown_msg);
+}
+
+TEST_F(Test, TestGroupBeforeInit) {
+    using ST = PolicyGroup::STATE;
+    using EV = PolicyGroup::EVENT;
+
+    seedsm::ManualBackend backend;
+    seedsm::StateMachineGroup<PolicyGroup> group(backend);
+    SMBackend sm(backend);
+    group.add(&sm);
+    group.start();
+
+    // pending before the init wakeup of the member, which runs after it
+    group.broadcast<EV::START>();
+    sm.start();
+    backend.poll();
+
+    EXPECT_TRUE(sm.is_in(ST::RUN));
+}
+
+TEST_F(Test, TestGroupSharedDefinition) {
+    using ST = PolicyGroup::STATE;
+    using EV = PolicyGroup::EVENT;
+    using Machine = seedsm::StateMachine<PolicyGroup>;
+
+    int shutdowns = 0;
+    Machine::definition_type def("Root");
+    def.create_states({ST::IDLE, ST::RUN, ST::DONE});
+    def.add_transition<EV::START>(ST::IDLE, ST::RUN);
+    def.add_transition<EV::SHUTDOWN>(ST::RUN, ST::DONE);
+    def.on_transition<EV::SHUTDOWN>(
+        ST::RUN, [&](Machine&, const std::string&) { ++shutdowns; });
+
+    seedsm::ManualBackend backend;
+    seedsm::StateMachineGroup<PolicyGroup> group(backend);
+    std::vector<std::unique_ptr<Machine>> machines;
+    for (int i = 0; i < 1000; i++) {
+        machines.emplace_back(new Machine(def, backend));
+        group.add(machines.back().get());
+        machines.back()->start();
+    }
+    // with a definition of its own
+    SMBackend own(backend);
+    group.add(&own);
+    own.start();
+    group.start();
+    backend.poll();
+
+    for (int i = 0; i < 1000; i += 2) {
+        machines[i]->send<EV::START>();
+    }
+    own.send<EV::START>();
+    backend.poll();
+
+    // only the running members have a transition for it
+    group.broadcast<EV::SHUTDOWN>("bye");
+    backend.poll();
+
+    EXPECT_EQ(500, shutdowns);
+    for (int i = 0; i < 1000; i++) {
+        EXPECT_EQ(i % 2 == 0, machines[i]->is_in(ST::DONE));
+        EXPECT_EQ(i % 2 != 0, machines[i]->is_in(ST::IDLE));
+    }
+    EXPECT_EQ("bye", own.shutdown_msg);
+}
+
+TEST_F(Test, TestEpollBackend) {
+    using EV = PolicyGroup::EVENT;
+
+    seedsm::EpollBackend backend;
+    SMBackend sm(backend);
+    seedsm::StateMachineGroup<PolicyGroup> group(backend);
+    group.add(&sm);
+
+    std::thread broadcaster;
+    sm.on_state_entered(PolicyGroup::RUN, [&] {
+        broadcaster =
+            std::thread([&] { group.broadcast<EV::SHUTDOWN>("epoll"); });
+    });
+    sm.on_state_entered(PolicyGroup::DONE, [&] { group.stop(); });
+
+    sm.start();
+    group.start();
+
+    std::thread producer([&] { sm.send<EV::START>(); });
+
+    backend.run();
+    producer.join();
+    broadcaster.join();
+
+    EXPECT_EQ("epoll", sm.shutdown_msg);
+}
+}
+
+namespace {
+
+TEST_F(Test, TestBusyPollBackend) {
+    using EV = PolicyGroup::EVENT;
+
+    // never stops spinning
+    seedsm::BusyPollBackend backend(std::numeric_limits<size_t>::max(), 0);
+    SMBackend sm(backend);
+    sm.start();
+
+    cpu_set_t before, after;
+    std::thread dispatcher([&] {
+        pthread_getaffinity_np(pthread_self(), sizeof(before), &before);
+        backend.run(0);
+        pthread_getaffinity_np(pthread_self(), sizeof(after), &after);
+    });
+
+    sm.send<EV::START>();
+    sm.send<EV::SHUTDOWN>("busy");
+
+    dispatcher.join();
+
+    EXPECT_EQ("busy", sm.shutdown_msg);
+    // the producer never had to wake the spinning dispatcher
+    EXPECT_EQ(0u, backend.park_count());
+    EXPECT_EQ(0u, backend.wake_count());
+    EXPECT_TRUE(CPU_EQUAL(&before, &after));
+}
+
+TEST_F(Test, TestBusyPollBackendPark) {
+    using EV = PolicyGroup::EVENT;
+
+    // parks as soon as there is nothing to dispatch
+    seedsm::BusyPollBackend backend(0, 0);
+    SMBackend sm(backend);
+    sm.start();
+
+    std::thread dispatcher([&] { backend.run(); });
+
+    while (backend.park_count() == 0) {
+        std::this_thread::yield();
+    }
+    sm.send<EV::START>();
+    sm.send<EV::SHUTDOWN>("parked");
+
+    dispatcher.join();
+
+    EXPECT_EQ("parked", sm.shutdown_msg);
+    EXPECT_LE(1u, backend.wake_count());
+}
+}
+
+namespace {
+
+struct SMBudget : public seedsm::StateMachine<PolicyAlloc> {
+    using ST = PolicyAlloc::STATE;
+    using EV = PolicyAlloc::EVENT;
+
+    SMBudget(seedsm::Backend& backend)
+        : StateMachine("Root", backend) {
+        create_states({ST::A, ST::B});
+        add_transition<EV::TOGGLE>(ST::A, ST::B);
+        add_transition<EV::TOGGLE>(ST::B, ST::A);
+
+        on_state_entered(ST::A, [this] { enter_cnt++; });
+        on_state_entered(ST::B, [this] { enter_cnt++; });
+    }
+
+    int enter_cnt = 0;
+};
+
+TEST_F(Test, TestDispatchBudgetEvents) {
+    using EV = PolicyAlloc::EVENT;
+
+    seedsm::ManualBackend backend;
+    SMBudget sm(backend);
+    sm.set_dispatch_budget(2);
+    sm.start();
+
+    for (int i = 0; i < 5; i++) {
+        sm.send<EV::TOGGLE>();
+    }
+
+    backend.poll();
+    EXPECT_EQ(3, sm.enter_cnt);  // initial state and 2 events
+    EXPECT_EQ(1u, sm.budget_exhausted_count());
+
+    backend.poll();
+    EXPECT_EQ(5, sm.enter_cnt);
+    EXPECT_EQ(2u, sm.budget_exhausted_count());
+
+    backend.poll();
+    EXPECT_EQ(6, sm.enter_cnt);
+    EXPECT_EQ(2u, sm.budget_exhausted_count());
+    EXPECT_FALSE(backend.has_pending());
+}
+
+TEST_F(Test, TestDispatchBudgetTime) {
+    using EV = PolicyAlloc::EVENT;
+
+    seedsm::ManualBackend backend;
+    SMBudget sm(backend);
+    sm.set_dispatch_budget(0, std::chrono::nanoseconds(1));
+    sm.start();
+
+    for (int i = 0; i < 3; i++) {
+        sm.send<EV::TOGGLE>();
+    }
+
+    // at least one event is dispatched by each wakeup
+    for (int i = 0; i < 3; i++) {
+        backend.poll();
+        EXPECT_EQ(2 + i, sm.enter_cnt);
+    }
+    EXPECT_EQ(2u, sm.budget_exhausted_count());
+    EXPECT_FALSE(backend.has_pending());
+}
+}
+
+struct PolicySession {
+    enum STATE { CONNECTING, OPEN, OPEN_IDLE, OPEN_BUSY, CLOSED };
+    enum EVENT { CONNECTED, REQUEST, DONE, CLOSE };
+};
+
+DEFINE_EVENT(PolicySession::CONNECTED);
+DEFINE_EVENT_WITH_DATA(PolicySession::REQUEST, int);
+DEFINE_EVENT(PolicySession::DONE);
+DEFINE_EVENT(PolicySession::CLOSE);
+
+namespace {
+
+struct Session
+    : public seedsm::StateMachineInstance<PolicySession, Session> {
+    using ST = PolicySession::STATE;
+    using EV = PolicySession::EVENT;
+
+    Session(const definition_type& def) : StateMachineInstance(def) {}
+
+    static const definition_type& shared_definition() {
+        static definition_type def("Session");
+        static bool built = build(def);
+        (void)built;
+        return def;
+    }
+
+    static bool build(definition_type& def) {
+        def.create_states({ST::CONNECTING, ST::OPEN, ST::CLOSED});
+        def.create_states(ST::OPEN, {ST::OPEN_IDLE, ST::OPEN_BUSY});
+
+        def.add_transition<EV::CONNECTED>(ST::CONNECTING, ST::OPEN);
+        def.add_transition<EV::REQUEST>(ST::OPEN_IDLE, ST::OPEN_BUSY);
+        def.add_transition<EV::DONE>(ST::OPEN_BUSY, ST::OPEN_IDLE);
+        def.add_transition<EV::CLOSE>(ST::OPEN, ST::CLOSED);
+
+        def.on_transition<EV::REQUEST>(ST::OPEN_IDLE, [](Session& s, int n) {
+            s.requests += n;
+            // queued until the REQUEST transition is complete
+            s.send<EV::DONE>();
+        });
+        def.on_state_entered(ST::OPEN_IDLE, [](Session& s) { s.idle_cnt++; });
+        return true;
+    }
+
+    int requests = 0;
+    int idle_cnt = 0;
+};
+
+TEST_F(Test, TestSharedDefinition) {
+    using ST = PolicySession::STATE;
+    using EV = PolicySession::EVENT;
+
+    const auto& def = Session::shared_definition();
+    std::vector<std::unique_ptr<Session>> sessions;
+    for (int i = 0; i < 100; i++) {
+        sessions.emplace_back(new Session(def));
+        sessions.back()->start();
+    }
+
+    for (int i = 0; i < 100; i += 2) {
+        sessions[i]->send<EV::CONNECTED>();
+        sessions[i]->send<EV::REQUEST>(i);
+    }
+
+    for (int i = 0; i < 100; i++) {
+        auto& s = *sessions[i];
+        if (i % 2 == 0) {
+            EXPECT_TRUE(s.is_active(ST::OPEN));
+            EXPECT_TRUE(s.is_active(ST::OPEN_IDLE));
+            EXPECT_EQ(i, s.requests);
+            EXPECT_EQ(2, s.idle_cnt);
+        } else {
+            EXPECT_TRUE(s.is_active(ST::CONNECTING));
+            EXPECT_EQ(0, s.requests);
+        }
+    }
+
+    sessions[0]->send<EV::CLOSE>();
+    EXPECT_TRUE(sessions[0]->is_active(ST::CLOSED));
+    EXPECT_FALSE(sessions[0]->is_active(ST::OPEN_IDLE));
+}
+
+TEST_F(Test, TestInstanceSize) {
+    using Instance = seedsm::StateMachineInstance<PolicySession>;
+
+    // definition pointer, resources, configuration and event queues
+    EXPECT_GE(72u, sizeof(Instance));
+
+    Instance::definition_type def("Root");
+    def.create_states({PolicySession::CONNECTING, PolicySession::OPEN});
+    def.add_transition<PolicySession::CONNECTED>(PolicySession::CONNECTING,
+                                                 PolicySession::OPEN);
+
+    size_t before = new_count;
+    {
+        Instance instance(def);
+        instance.start();
+        instance.send<PolicySession::CONNECTED>();
+        EXPECT_TRUE(instance.is_active(PolicySession::OPEN));
+    }
+    // the event only
+    EXPECT_EQ(1u, new_count - before);
+}
+}
+
+struct PolicyShm {
+    enum STATE { COUNTING, DONE };
+    enum EVENT { ADD, FIN };
+};
+
+struct Sample {
+    int32_t value;
+    double weight;
+};
+
+DEFINE_EVENT_WITH_DATA(PolicyShm::ADD, Sample);
+DEFINE_EVENT(PolicyShm::FIN);
+
+namespace {
+
+struct SMShm : public seedsm::StateMachine<PolicyShm> {
+    using ST = PolicyShm::STATE;
+    using EV = PolicyShm::EVENT;
+
+    SMShm(seedsm::Backend& backend) : StateMachine("Root", backend) {
+        create_states({ST::COUNTING, ST::DONE});
+        add_transition<EV::ADD>(ST::COUNTING);
+        add_transition<EV::FIN>(ST::COUNTING, ST::DONE);
+
+        on_transition<EV::ADD>(ST::COUNTING, [this](const Sample& s) {
+            if (s.value != count) ordered = false;
+            ++count;
+            total += s.value * s.weight;
+        });
+        on_state_entered(ST::DONE, [this] { stop(); });
+    }
+
+    int32_t count = 0;
+    double total = 0;
+    bool ordered = true;
+};
+
+TEST_F(Test, TestShmTransport) {
+    using EV = PolicyShm::EVENT;
+
+    auto name = "seedsm-test-" + std::to_string(getpid());
+
+    ev::dynamic_loop loop;
+    seedsm::LibevBackend backend(loop);
+    SMShm sm(backend);
+    // small ring for the producer to fill it
+    seedsm::ShmReceiver<PolicyShm> receiver(sm, name, 16);
+    receiver.accept<EV::ADD>();
+    receiver.accept<EV::FIN>();
+    sm.on_state_entered(PolicyShm::DONE, [&] { receiver.stop(); });
+
+    pid_t pid = fork();
+    ASSERT_LE(0, pid);
+    if (pid == 0) {
+        seedsm::ShmSender<PolicyShm> sender(name);
+        for (int32_t i = 0; i < 1000; ++i) {
+            while (!sender.send<EV::ADD>(Sample{i, 0.5})) {
+                std::this_thread::yield();
+            }
+        }
+        while (!sender.send<EV::FIN>()) {
+            std::this_thread::yield();
+        }
+        _exit(0);
+    }
+
+    sm.start();
+    receiver.start();
+    loop.run(0);
+
+    int status;
+    waitpid(pid, &status, 0);
+    EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    EXPECT_EQ(1000, sm.count);
+    EXPECT_TRUE(sm.ordered);
+    EXPECT_DOUBLE_EQ(999 * 1000 / 2 * 0.5, sm.total);
+}
+
+TEST_F(Test, TestShmTransportManual) {
+    using EV = PolicyShm::EVENT;
+
+    auto name = "seedsm-test-manual-" + std::to_string(getpid());
+
+    seedsm::ManualBackend backend;
+    SMShm sm(backend);
+    seedsm::ShmReceiver<PolicyShm> receiver(sm, name, 4);
+    receiver.accept<EV::ADD>();
+
+    sm.start();
+    receiver.start();
+    backend.poll();
+
+    seedsm::ShmSender<PolicyShm> sender(name);
+    for (int32_t i = 0; i < 4; ++i) {
+        EXPECT_TRUE(sender.send<EV::ADD>(Sample{i, 1}));
+    }
+    EXPECT_FALSE(sender.send<EV::ADD>(Sample{4, 1}));
+
+    // no doorbell without a descriptor watch: the host polls
+    EXPECT_EQ(4u, receiver.poll());
+    EXPECT_EQ(0u, sender.doorbell_count());
+
+    // not accepted, dropped
+    EXPECT_TRUE(sender.send<EV::FIN>());
+    EXPECT_EQ(1u, receiver.poll());
+
+    // foreign writer, payload of the wrong size: dropped
+    seedsm::_inner::ShmSegment segment;
+    ASSERT_TRUE(segment.open("/" + name));
+    int32_t truncated = 5;
+    EXPECT_TRUE(segment.push(EV::ADD, &truncated, sizeof(truncated)));
+    EXPECT_EQ(1u, receiver.poll());
+
+    EXPECT_EQ(4, sm.count);
+    EXPECT_TRUE(sm.ordered);
+}
+
+TEST_F(Test, TestShmTransportBusyPoll) {
+    using EV = PolicyShm::EVENT;
+
+    auto name = "seedsm-test-busy-" + std::to_string(getpid());
+
+    // would park as soon as there is nothing to dispatch
+    seedsm::BusyPollBackend backend(0, 0);
+    SMShm sm(backend);
+    seedsm::ShmReceiver<PolicyShm> receiver(sm, name, 8);
+    receiver.accept<EV::ADD>();
+    receiver.accept<EV::FIN>();
+    sm.on_state_entered(PolicyShm::DONE, [&] { receiver.stop(); });
+    sm.start();
+    receiver.start();
+
+    std::thread dispatcher([&] { backend.run(); });
+
+    // the sender shows up once the ring was found empty
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    seedsm::ShmSender<PolicyShm> sender(name);
+    ASSERT_TRUE(sender.is_open());
+    for (int32_t i = 0; i < 5; ++i) {
+        while (!sender.send<EV::ADD>(Sample{i, 1})) {
+            std::this_thread::yield();
+        }
+    }
+    while (!sender.send<EV::FIN>()) {
+        std::this_thread::yield();
+    }
+
+    for (int i = 0; i < 1000 && !sm.is_in(PolicyShm::DONE); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    backend.quit();
+    dispatcher.join();
+
+    EXPECT_EQ(5, sm.count);
+    EXPECT_TRUE(sm.ordered);
+    EXPECT_EQ(0u, backend.park_count());
+    EXPECT_EQ(0u, sender.doorbell_count());
+}
+
+TEST_F(Test, TestShmCorruptHeader) {
+    using EV = PolicyShm::EVENT;
+
+    auto name = "seedsm-test-corrupt-" + std::to_string(getpid());
+
+    seedsm::ManualBackend backend;
+    SMShm sm(backend);
+    seedsm::ShmReceiver<PolicyShm> receiver(sm, name, 4);
+    receiver.accept<EV::ADD>();
+    sm.start();
+    receiver.start();
+    backend.poll();
+
+    seedsm::ShmSender<PolicyShm> sender(name);
+    ASSERT_TRUE(sender.is_open());
+
+    // a foreign writer breaks the geometry of the ring
+    seedsm::_inner::ShmSegment segment;
+    ASSERT_TRUE(segment.open("/" + name));
+    segment.header()->slot_size = 1 << 30;
+    segment.header()->capacity = uint64_t(1) << 40;
+
+    // mapped segments keep the geometry they were opened with
+    EXPECT_TRUE(sender.send<EV::ADD>(Sample{0, 1}));
+    EXPECT_EQ(1u, receiver.poll());
+    EXPECT_EQ(1, sm.count);
+
+    seedsm::ShmSender<PolicyShm> late(name);
+    EXPECT_FALSE(late.is_open());
+
+    segment.header()->enqueue_pos.store(uint64_t(1) << 62);
+    EXPECT_FALSE(sender.send<EV::ADD>(Sample{1, 1}));
+    EXPECT_EQ(0u, receiver.poll());
+    EXPECT_EQ(1, sm.count);
+}
+
+TEST_F(Test, TestShmSenderThreads) {
+    using EV = PolicyShm::EVENT;
+
+    auto name = "seedsm-test-threads-" + std::to_string(getpid());
+
+    seedsm::EpollBackend backend;
+    SMShm sm(backend);
+    seedsm::ShmReceiver<PolicyShm> receiver(sm, name, 16);
+    receiver.accept<EV::ADD>();
+    receiver.accept<EV::FIN>();
+    sm.on_state_entered(PolicyShm::DONE, [&] { receiver.stop(); });
+    sm.start();
+    receiver.start();
+
+    // one sender shared by the producer threads
+    seedsm::ShmSender<PolicyShm> sender(name);
+    ASSERT_TRUE(sender.is_open());
+    std::thread producer([&] {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&] {
+                for (int32_t i = 0; i < 250; ++i) {
+                    while (!sender.send<EV::ADD>(Sample{1, 1})) {
+                        std::this_thread::yield();
+                    }
+                }
+            });
+        }
+        for (auto&& t : threads) t.join();
+        while (!sender.send<EV::FIN>()) {
+            std::this_thread::yield();
+        }
+    });
+
+    backend.run();
+    producer.join();
+
+    EXPECT_EQ(1000, sm.count);
+    EXPECT_DOUBLE_EQ(1000, sm.total);
+}
+
+TEST_F(Test, TestShmSenderRetry) {
+    using EV = PolicyShm::EVENT;
+
+    auto name = "seedsm-test-retry-" + std::to_string(getpid());
+
+    // no receiver yet
+    seedsm::ShmSender<PolicyShm> sender(name);
+    EXPECT_FALSE(sender.is_open());
+    EXPECT_FALSE(sender.send<EV::ADD>(Sample{0, 1}));
+
+    seedsm::EpollBackend backend;
+    SMShm sm(backend);
+    {
+        seedsm::ShmReceiver<PolicyShm> receiver(sm, name);
+        receiver.accept<EV::ADD>();
+        sm.start();
+        receiver.start();
+        backend.run_once(0);  // finds the ring empty, waits for the doorbell
+
+        EXPECT_TRUE(sender.open(name));
+        EXPECT_TRUE(sender.send<EV::ADD>(Sample{0, 1}));
+        EXPECT_EQ(1u, sender.doorbell_count());
+        backend.run_once(0);
+        EXPECT_EQ(1, sm.count);
+    }
+
+    // the receiver is gone: the doorbell fails without SIGPIPE
+    EXPECT_FALSE(sender.send<EV::ADD>(Sample{1, 1}));
+    EXPECT_FALSE(sender.is_open());
+    EXPECT_FALSE(sender.open(name));
+
+    {
+        seedsm::ShmReceiver<PolicyShm> receiver(sm, name);
+        receiver.accept<EV::ADD>();
+        receiver.start();
+        backend.run_once(0);
+        receiver.stop();
+
+        EXPECT_TRUE(sender.open(name));
+    }
+
+    // gone while stopped, so without waiting for the doorbell
+    EXPECT_FALSE(sender.send<EV::ADD>(Sample{2, 1}));
+    EXPECT_FALSE(sender.is_open());
+    EXPECT_EQ(1, sm.count);
+}
+}
+
+struct PolicyDefer {
+    enum STATE { CONNECTING, OPEN, CLOSED };
+    enum EVENT { CONNECTED, DATA, CLOSE };
+};
+
+DEFINE_EVENT(PolicyDefer::CONNECTED);
+DEFINE_EVENT_WITH_DATA(PolicyDefer::DATA, int);
+DEFINE_EVENT(PolicyDefer::CLOSE);
+
+// S1 handles Y and still defers X, S2 handles both
+struct PolicyStage {
+    enum STATE { S0, S1, S2 };
+    enum EVENT { X, Y, GO };
+};
+
+DEFINE_EVENT_WITH_DATA(PolicyStage::X, int);
+DEFINE_EVENT_WITH_DATA(PolicyStage::Y, int);
+DEFINE_EVENT(PolicyStage::GO);
+
+namespace {
+
+struct SMDefer : public seedsm::StateMachine<PolicyDefer> {
+    using ST = PolicyDefer::STATE;
+    using EV = PolicyDefer::EVENT;
+
+    SMDefer(seedsm::Backend& backend) : StateMachine("Root", backend) {
+        create_states({ST::CONNECTING, ST::OPEN, ST::CLOSED});
+        add_transition<EV::CONNECTED>(ST::CONNECTING, ST::OPEN);
+        add_transition<EV::CLOSE>(ST::CONNECTING, ST::CLOSED);
+        add_transition<EV::CONNECTED>(ST::CLOSED, ST::OPEN);
+        add_transition<EV::DATA>(ST::OPEN);
+        defer<EV::DATA>(ST::CONNECTING);
+
+        on_transition<EV::DATA>(ST::OPEN,
+                                [this](int n) { received.push_back(n); });
+    }
+
+    std::vector<int> received;
+};
+
+struct SMStage : public seedsm::StateMachine<PolicyStage> {
+    using ST = PolicyStage::STATE;
+    using EV = PolicyStage::EVENT;
+
+    SMStage(seedsm::Backend& backend) : StateMachine("Root", backend) {
+        create_states({ST::S0, ST::S1, ST::S2});
+        add_transition<EV::GO>(ST::S0, ST::S1);
+        add_transition<EV::Y>(ST::S1, ST::S2);
+        add_transition<EV::X>(ST::S2);
+        add_transition<EV::Y>(ST::S2);
+        defer<EV::X>(ST::S0);
+        defer<EV::Y>(ST::S0);
+        defer<EV::X>(ST::S1);
+
+        auto record = [this](int n) { received.push_back(n); };
+        on_transition<EV::Y>(ST::S1, record);
+        on_transition<EV::X>(ST::S2, record);
+        on_transition<EV::Y>(ST::S2, record);
+    }
+
+    std::vector<int> received;
+};
+
+TEST_F(Test, TestDeferral) {
+    using EV = PolicyDefer::EVENT;
+
+    seedsm::ManualBackend backend;
+    SMDefer sm(backend);
+    sm.start();
+    backend.poll();
+
+    sm.send<EV::DATA>(1);
+    sm.send<EV::DATA>(2);
+    backend.poll();
+    EXPECT_TRUE(sm.received.empty());
+
+    // released ahead of the queued event
+    sm.send<EV::CONNECTED>();
+    sm.send<EV::DATA>(3);
+    backend.poll();
+    EXPECT_EQ((std::vector<int>{1, 2, 3}), sm.received);
+    EXPECT_FALSE(backend.has_pending());
+
+    // kept through a configuration which doesn't handle it
+    SMDefer closed(backend);
+    closed.start();
+    closed.send<EV::DATA>(4);
+    closed.send<EV::CLOSE>();
+    backend.poll();
+    EXPECT_TRUE(closed.is_in(PolicyDefer::CLOSED));
+    EXPECT_TRUE(closed.received.empty());
+
+    closed.send<EV::CONNECTED>();
+    backend.poll();
+    EXPECT_EQ(std::vector<int>{4}, closed.received);
+
+    // released by a later step, behind the ones released before
+    SMStage staged(backend);
+    staged.start();
+    backend.poll();
+    staged.send<PolicyStage::Y>(1);
+    staged.send<PolicyStage::Y>(2);
+    staged.send<PolicyStage::X>(3);
+    staged.send<PolicyStage::GO>();
+    backend.poll();
+    EXPECT_EQ((std::vector<int>{1, 2, 3}), staged.received);
+}
+
+TEST_F(Test, TestDeferralBroadcast) {
+    using EV = PolicyDefer::EVENT;
+
+    seedsm::ManualBackend backend;
+    seedsm::StateMachineGroup<PolicyDefer> group(backend);
+    SMDefer connecting(backend), connected(backend);
+    group.add(&connecting);
+    group.add(&connected);
+    group.start();
+    connecting.start();
+    connected.start();
+    connected.send<EV::CONNECTED>();
+    backend.poll();
+
+    group.broadcast<EV::DATA>(1);
+    backend.poll();
+    EXPECT_TRUE(connecting.received.empty());
+    EXPECT_EQ(std::vector<int>{1}, connected.received);
+
+    // the parked reference outlives the broadcast
+    connecting.send<EV::CONNECTED>();
+    backend.poll();
+    EXPECT_EQ(std::vector<int>{1}, connecting.received);
+    EXPECT_FALSE(backend.has_pending());
+}
+
+TEST_F(Test, TestDeferralInstance) {
+    using ST = PolicyDefer::STATE;
+    using EV = PolicyDefer::EVENT;
+    using Instance = seedsm::StateMachineInstance<PolicyDefer>;
+
+    std::vector<int> received;
+
+    Instance::definition_type def("Root");
+    def.create_states({ST::CONNECTING, ST::OPEN, ST::CLOSED});
+    def.add_transition<EV::CONNECTED>(ST::CONNECTING, ST::OPEN);
+    def.add_transition<EV::CLOSE>(ST::CONNECTING, ST::CLOSED);
+    def.add_transition<EV::CONNECTED>(ST::CLOSED, ST::OPEN);
+    def.add_transition<EV::DATA>(ST::OPEN);
+    def.defer<EV::DATA>(ST::CONNECTING);
+    def.on_transition<EV::DATA>(
+        ST::OPEN, [&](Instance&, int n) { received.push_back(n); });
+
+    Instance connected(def);
+    connected.start();
+    connected.send<EV::DATA>(1);
+    connected.send<EV::DATA>(2);
+    EXPECT_TRUE(received.empty());
+    connected.send<EV::CONNECTED>();
+    EXPECT_EQ((std::vector<int>{1, 2}), received);
+
+    // kept through a configuration which doesn't handle it
+    Instance closed(def);
+    closed.start();
+    closed.send<EV::DATA>(3);
+    closed.send<EV::CLOSE>();
+    EXPECT_TRUE(closed.is_active(ST::CLOSED));
+    EXPECT_EQ(2u, received.size());
+    closed.send<EV::CONNECTED>();
+    EXPECT_EQ((std::vector<int>{1, 2, 3}), received);
+
+    // still parked, destroyed with the instance
+    Instance pending(def);
+    pending.start();
+    pending.send<EV::DATA>(4);
+
+    // released by a later step, behind the ones released before
+    using Staged = seedsm::StateMachineInstance<PolicyStage>;
+    using SST = PolicyStage::STATE;
+    using SEV = PolicyStage::EVENT;
+
+    std::vector<int> staged_received;
+    auto record = [&](Staged&, int n) { staged_received.push_back(n); };
+
+    Staged::definition_type staged_def("Root");
+    staged_def.create_states({SST::S0, SST::S1, SST::S2});
+    staged_def.add_transition<SEV::GO>(SST::S0, SST::S1);
+    staged_def.add_transition<SEV::Y>(SST::S1, SST::S2);
+    staged_def.add_transition<SEV::X>(SST::S2);
+    staged_def.add_transition<SEV::Y>(SST::S2);
+    staged_def.defer<SEV::X>(SST::S0);
+    staged_def.defer<SEV::Y>(SST::S0);
+    staged_def.defer<SEV::X>(SST::S1);
+    staged_def.on_transition<SEV::Y>(SST::S1, record);
+    staged_def.on_transition<SEV::X>(SST::S2, record);
+    staged_def.on_transition<SEV::Y>(SST::S2, record);
+
+    Staged staged(staged_def);
+    staged.start();
+    staged.send<SEV::Y>(1);
+    staged.send<SEV::Y>(2);
+    staged.send<SEV::X>(3);
+    staged.send<SEV::GO>();
+    EXPECT_EQ((std::vector<int>{1, 2, 3}), staged_received);
+}
+}
+
+namespace {
+
+TEST_F(Test, TestStateQuery) {
+    using ST = PolicyAlloc::STATE;
+    using EV = PolicyAlloc::EVENT;
+
+    seedsm::ManualBackend backend;
+    SMBudget sm(backend);
+    EXPECT_FALSE(sm.is_in(ST::A));
+
+    sm.start();
+    backend.poll();
+    EXPECT_TRUE(sm.is_in(ST::A));
+
+    std::atomic<bool> done{false};
+    std::thread reader([&] {
+        while (!done) {
+            auto s = sm.snapshot();
+            EXPECT_NE(s.is_in(ST::A), s.is_in(ST::B));
+            std::this_thread::yield();
+        }
+    });
+
+    for (int i = 0; i < 1000; ++i) {
+        sm.send<EV::TOGGLE>();
+        backend.poll();
+    }
+    done = true;
+    reader.join();
+
+    EXPECT_TRUE(sm.is_in(ST::A));
+    EXPECT_FALSE(sm.is_in(ST::B));
+}
+
+TEST_F(Test, TestStateQueryWide) {
+    using EV = PolicyWide::EVENT;
+
+    seedsm::ManualBackend backend;
+    SMWide sm(backend);
+    sm.start();
+    backend.poll();
+    EXPECT_TRUE(sm.is_in(PolicyWide::FIRST));
+
+    std::atomic<bool> done{false};
+    std::thread reader([&] {
+        while (!done) {
+            // exactly one state of the ring
+            size_t active = 0;
+            sm.snapshot().for_each_active([&](PolicyWide::STATE) { ++active; });
+            EXPECT_EQ(1u, active);
+            std::this_thread::yield();
+        }
+    });
+
+    for (int i = 0; i < 1050; ++i) {
+        sm.send<EV::NEXT>();
+        backend.poll();
+    }
+    done = true;
+    reader.join();
+
+    auto s = sm.snapshot();
+    EXPECT_TRUE(s.is_in(static_cast<PolicyWide::STATE>(1050 % 300)));
+    EXPECT_TRUE(sm.is_in(static_cast<PolicyWide::STATE>(1050 % 300)));
+    EXPECT_FALSE(sm.is_in(PolicyWide::FIRST));
+}
+}
+
+namespace {
+
+struct Connection : public seedsm::StateMachine<PolicyDefer, Connection> {
+    using StateMachine::StateMachine;
+
+    int data = 0;
+};
+
+TEST_F(Test, TestSharedDefinitionMachines) {
+    using ST = PolicyDefer::STATE;
+    using EV = PolicyDefer::EVENT;
+
+    CountingResource resource;
+
+    // the callbacks act on the machine being dispatched
+    Connection::definition_type def("Root", &resource);
+    def.create_states({ST::CONNECTING, ST::OPEN, ST::CLOSED});
+    def.add_transition<EV::CONNECTED>(ST::CONNECTING, ST::OPEN);
+    def.add_transition<EV::DATA>(ST::OPEN);
+    def.add_transition<EV::CLOSE>(ST::OPEN, ST::CLOSED);
+    def.defer<EV::DATA>(ST::CONNECTING);
+    def.on_transition<EV::DATA>(ST::OPEN,
+                                [](Connection& s, int n) { s.data += n; });
+    def.on_state_entered(ST::OPEN,
+                         [](Connection& s) { s.send<EV::DATA>(1000); });
+    def.on_state_entered(ST::CLOSED, [](Connection& s) { s.stop(); });
+    size_t definition_allocations = resource.allocations;
+
+    seedsm::ManualBackend backend;
+    std::vector<std::unique_ptr<Connection>> machines;
+    for (int i = 0; i < 100; i++) {
+        size_t before = resource.allocations;
+        machines.emplace_back(new Connection(def, backend, &resource));
+        // wakeups and queues only: nothing of the definition is copied
+        EXPECT_GT(definition_allocations, resource.allocations - before);
+        machines.back()->start();
+    }
+    backend.poll();
+
+    for (int i = 0; i < 100; i += 2) {
+        machines[i]->send<EV::DATA>(i);
+        machines[i]->send<EV::CONNECTED>();
+    }
+    backend.poll();
+
+    for (int i = 0; i < 100; i++) {
+        EXPECT_EQ(i % 2 == 0, machines[i]->is_in(ST::OPEN));
+        EXPECT_EQ(i % 2 == 0 ? i + 1000 : 0, machines[i]->data);
+    }
+
+    // stopped by their own callback: later events stay queued
+    machines[0]->send<EV::CLOSE>();
+    backend.poll();
+    machines[0]->send<EV::DATA>(1);
+    backend.poll();
+    EXPECT_TRUE(machines[0]->is_in(ST::CLOSED));
+    EXPECT_EQ(1000, machines[0]->data);
+}
+}